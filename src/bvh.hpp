@@ -0,0 +1,83 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "geometry.hpp"
+
+/*
+	Median split BVH shared by the sphere cloud, the out of core clusters and the light tree.
+	Nodes are stored depth first: the left child follows its parent, the parent keeps the right one in offset.
+	Node needs bb_min[3], bb_max[3] and offset, the rest is filled by the callbacks:
+		bounds(i, lo, hi)			box of primitive i, its center is what the split sorts by
+		on_leaf(node, first, count)	idx[first, first + count) are the primitives of the leaf
+		on_inner(node, axis)		called once both children are built
+*/
+template <class Node, class Bounds, class Leaf, class Inner>
+unsigned bvh_build(std::vector<Node>& nodes, std::vector<unsigned>& idx, const unsigned first, const unsigned count, const unsigned max_leaf,
+	const Bounds& bounds, const Leaf& on_leaf, const Inner& on_inner)
+{
+	unsigned ni = unsigned(nodes.size());
+	nodes.push_back(Node());
+	Vec3f bmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+	Vec3f bmax = -bmin, cmin = bmin, cmax = -bmin;
+	for (unsigned k = first; k < first + count; k++)
+	{
+		Vec3f lo, hi;
+		bounds(idx[k], lo, hi);
+		for (int j = 0; j < 3; j++)
+		{
+			bmin[j] = std::min(bmin[j], lo[j]);
+			bmax[j] = std::max(bmax[j], hi[j]);
+			cmin[j] = std::min(cmin[j], lo[j] + hi[j]);
+			cmax[j] = std::max(cmax[j], lo[j] + hi[j]);
+		}
+	}
+	for (int j = 0; j < 3; j++)
+	{
+		nodes[ni].bb_min[j] = bmin[j];
+		nodes[ni].bb_max[j] = bmax[j];
+	}
+	if (count <= max_leaf)
+	{
+		on_leaf(nodes[ni], first, count);
+		return ni;
+	}
+
+	//median split of the box centers along their largest extent
+	int axis = 0;
+	for (int j = 1; j < 3; j++)
+		if (cmax[j] - cmin[j] > cmax[axis] - cmin[axis])
+			axis = j;
+	auto center = [&](const unsigned i)
+	{
+		Vec3f lo, hi;
+		bounds(i, lo, hi);
+		return lo[axis] + hi[axis];
+	};
+	unsigned half = count / 2;
+	std::nth_element(idx.begin() + first, idx.begin() + first + half, idx.begin() + first + count,
+		[&](const unsigned a, const unsigned b) { return center(a) < center(b); });
+
+	bvh_build(nodes, idx, first, half, max_leaf, bounds, on_leaf, on_inner);//left child is ni + 1
+	unsigned right = bvh_build(nodes, idx, first + half, count - half, max_leaf, bounds, on_leaf, on_inner);
+	nodes[ni].offset = right;
+	on_inner(nodes[ni], axis);
+	return ni;
+}
+
+//slab test of a node box against the ray segment [0, dist], inv is 1 / dir
+template <class Node>
+inline bool bvh_box_hit(const Node& node, const Vec3f& orig, const float* inv, const float dist)
+{
+	float tmin = 0, tmax = dist;
+	for (int j = 0; j < 3; j++)
+	{
+		float t0 = (node.bb_min[j] - orig[j]) * inv[j];
+		float t1 = (node.bb_max[j] - orig[j]) * inv[j];
+		tmin = std::max(tmin, std::min(t0, t1));
+		tmax = std::min(tmax, std::max(t0, t1));
+	}
+	return tmin <= tmax;
+}
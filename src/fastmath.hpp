@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#endif
+
+#include "geometry.hpp"
+
+/*
+	Approximate math for shading and ray generation.
+	Branch free polynomial approximations, inline so loops over arrays of them vectorize.
+	Error bounds are measured over the whole valid range of the argument:
+		fast_log2		absolute 2e-7 for x in [0.5, 2], beyond that the float rounding of the result, 4e-6 at |log2(x)| = 64
+		fast_exp2		relative 2e-7
+		fast_pow		relative 3e-7 * (|y * log2(x)| + 1)
+		fast_rsqrt		relative 3e-7, SSE estimate and one Newton step, 8e-7 from the bit estimate without SSE
+		fast_atan2		absolute 2e-6 radians
+		fast_asin		absolute 3e-7 radians
+*/
+
+inline uint32_t float_bits(const float x)
+{
+	uint32_t i;
+	memcpy(&i, &x, sizeof(i));
+	return i;
+}
+
+inline float bits_float(const uint32_t i)
+{
+	float x;
+	memcpy(&x, &i, sizeof(x));
+	return x;
+}
+
+//x > 0 and normal
+inline float fast_log2(const float x)
+{
+	uint32_t i = float_bits(x) - 0x3f400000;//mantissa into [0.75, 1.5), so log2 of x near 1 keeps its relative precision
+	float e = float(int32_t(i) >> 23);
+	float t = bits_float((i & 0x7fffff) + 0x3f400000) - 1.f;
+	//log2(1 + t) / t on [-0.25, 0.5), degree 7 fit at Chebyshev nodes
+	float p = -0.0938960967f;
+	p = p * t + 0.202076588f;
+	p = p * t - 0.250414432f;
+	p = p * t + 0.290264516f;
+	p = p * t - 0.360368292f;
+	p = p * t + 0.480842665f;
+	p = p * t - 0.72135008f;
+	p = p * t + 1.44269527f;
+	return e + t * p;
+}
+
+inline float fast_exp2(float x)
+{
+	x = std::max(-126.f, std::min(127.f, x));
+	float fi = std::floor(x);
+	float f = x - fi;//[0, 1)
+	//2^f, degree 5 fit at Chebyshev nodes
+	float p = 0.00189375406f;
+	p = p * f + 0.00894959042f;
+	p = p * f + 0.0558603371f;
+	p = p * f + 0.240141818f;
+	p = p * f + 0.69315449f;
+	p = p * f + 0.999999898f;
+	return bits_float(float_bits(p) + (uint32_t(int(fi)) << 23));
+}
+
+//x >= 0, y > 0
+inline float fast_pow(const float x, const float y)
+{
+	return x > 0 ? fast_exp2(y * fast_log2(x)) : 0.f;
+}
+
+//x > 0
+inline float fast_rsqrt(const float x)
+{
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));//12 bit estimate
+#else
+	float y = bits_float(0x5f1ffff9 - (float_bits(x) >> 1));
+	y *= 0.703952253f * (2.38924456f - x * y * y);
+#endif
+	return y * (1.5f - 0.5f * x * y * y);
+}
+
+inline float fast_atan2(const float y, const float x)
+{
+	const float pi = 3.14159265f;
+	float ax = std::fabs(x), ay = std::fabs(y);
+	float mx = std::max(ax, ay), mn = std::min(ax, ay);
+	float a = mx > 0 ? mn / mx : 0.f;
+	float s = a * a;
+	//atan on [0, 1], odd minimax polynomial
+	float r = -0.0117212f;
+	r = r * s + 0.05265332f;
+	r = r * s - 0.11643287f;
+	r = r * s + 0.19354346f;
+	r = r * s - 0.33262347f;
+	r = r * s + 0.99997726f;
+	r *= a;
+	r = ay > ax ? 0.5f * pi - r : r;
+	r = x < 0 ? pi - r : r;
+	return y < 0 ? -r : r;
+}
+
+//x in [-1, 1], Abramowitz and Stegun 4.4.46
+inline float fast_asin(const float x)
+{
+	const float pi = 3.14159265f;
+	float a = std::min(1.f, std::fabs(x));
+	float p = -0.0012624911f;
+	p = p * a + 0.0066700901f;
+	p = p * a - 0.0170881256f;
+	p = p * a + 0.0308918810f;
+	p = p * a - 0.0501743046f;
+	p = p * a + 0.0889789874f;
+	p = p * a - 0.2145988016f;
+	p = p * a + 1.5707963050f;
+	float r = 0.5f * pi - std::sqrt(1.f - a) * p;
+	return x < 0 ? -r : r;
+}
+
+/*
+	Exact and fast variants behind one name, FAST is a compile time choice so the kernels
+	built on them carry no per call branches.
+*/
+template <bool FAST> inline float math_pow(const float x, const float y)
+{
+	return FAST ? fast_pow(x, y) : powf(x, y);
+}
+
+template <bool FAST> inline Vec3f math_normalize(Vec3f v)
+{
+	return FAST ? v * fast_rsqrt(v * v) : v.normalize();
+}
+
+//direction and length of v with a single square root
+template <bool FAST> inline Vec3f math_direction(Vec3f v, float& length)
+{
+	if (FAST)
+	{
+		float d2 = v * v, inv = fast_rsqrt(d2);
+		length = d2 * inv;
+		return v * inv;
+	}
+	length = v.norm();
+	return v * (1.f / length);
+}
+
+//in render.cpp, process wide switch between the exact and the fast path
+bool fast_math_enabled();
+void set_fast_math(const bool enable);
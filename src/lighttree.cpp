@@ -0,0 +1,91 @@
+#include <cmath>
+#include <atomic>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+
+#include "util.hpp"
+#include "bvh.hpp"
+
+/*
+	Light tree: a BVH over the point lights, every node knows the summed intensity below it.
+	Sampling walks from the root and at each node picks a child with probability proportional to
+	its intensity over the squared distance to its box, the product of the choices is the pdf.
+	Every light with a nonzero intensity can be picked, so contribution / pdf is an unbiased
+	estimate of the sum over all lights and the average over frames converges to it.
+*/
+
+light_tree_t::light_tree_t(const std::vector<const Light_t*>& lights, const unsigned samples)
+	: samples(std::max(1u, samples)), nodes()
+{
+	if (lights.empty())
+		return;
+	std::vector<unsigned> idx(lights.size());
+	std::iota(idx.begin(), idx.end(), 0u);
+	nodes.reserve(2 * lights.size());
+	bvh_build(nodes, idx, 0, unsigned(idx.size()), 1,
+		[&](const unsigned i, Vec3f& lo, Vec3f& hi) { lo = hi = lights[i]->position; },
+		[&](node_t& leaf, const unsigned first, const unsigned)
+	{
+		leaf.offset = idx[first];
+		leaf.intensity = std::max(0.f, lights[idx[first]]->intensity);
+		leaf.leaf = true;
+	},
+		[this](node_t& inner, const int)
+	{
+		inner.intensity = (&inner)[1].intensity + nodes[inner.offset].intensity;//both children are built
+		inner.leaf = false;
+	});
+}
+
+//intensity over the squared distance to the box, not closer than half its diagonal so points inside stay finite
+float light_tree_t::importance(const node_t& node, const Vec3f& point) const
+{
+	float d2 = 0, diag2 = 0;
+	for (int j = 0; j < 3; j++)
+	{
+		float d = std::max(0.f, std::max(node.bb_min[j] - point[j], point[j] - node.bb_max[j]));
+		float e = node.bb_max[j] - node.bb_min[j];
+		d2 += d * d;
+		diag2 += e * e;
+	}
+	return node.intensity / std::max(std::max(d2, 0.25f * diag2), 1e-4f);
+}
+
+int light_tree_t::sample(const Vec3f& point, float u, float& pdf) const
+{
+	pdf = 1;
+	if (nodes.empty())
+		return -1;
+	unsigned ni = 0;
+	while (!nodes[ni].leaf)
+	{
+		unsigned left = ni + 1, right = nodes[ni].offset;
+		float il = importance(nodes[left], point), ir = importance(nodes[right], point);
+		float p = il + ir > 0 ? il / (il + ir) : 0.5f;
+		//u is reused for the next level, rescaled to [0, 1) within the chosen side
+		if (u < p)
+		{
+			u = std::min(u / p, 0.99999994f);
+			pdf *= p;
+			ni = left;
+		}
+		else
+		{
+			u = std::min((u - p) / (1 - p), 0.99999994f);
+			pdf *= 1 - p;
+			ni = right;
+		}
+	}
+	return int(nodes[ni].offset);
+}
+
+float light_rand()
+{
+	static std::atomic<unsigned> seeds(1);
+	thread_local unsigned state = (seeds++) * 0x9e3779b9u | 1u;
+	state ^= state << 13;//xorshift32
+	state ^= state >> 17;
+	state ^= state << 5;
+	return float(state >> 8) * (1.f / 16777216.f);
+}
@@ -0,0 +1,232 @@
+#include <cmath>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+#include "util.hpp"
+
+/*
+	Mesh simplification by edge collapse ordered by the quadric error metric
+	(Garland, Heckbert "Surface Simplification Using Quadric Error Metrics").
+	Every vertex keeps the sum of the squared distance quadrics of the planes of its faces,
+	the cheapest edge is collapsed into the point minimizing the summed quadric.
+	The error of a level also counts how far the faces turned from their normal in the full mesh:
+	a face of length l turned by the angle a moves its far side by l * sin(a), the flat shaded highlights move with it.
+*/
+
+struct quadric_t//symmetric 4x4: a11 a12 a13 a14 a22 a23 a24 a33 a34 a44
+{
+	quadric_t()
+		: m()
+	{}
+	double m[10];
+
+	void add_plane(const double a, const double b, const double c, const double d)
+	{
+		m[0] += a * a; m[1] += a * b; m[2] += a * c; m[3] += a * d;
+		m[4] += b * b; m[5] += b * c; m[6] += b * d;
+		m[7] += c * c; m[8] += c * d;
+		m[9] += d * d;
+	}
+	quadric_t& operator+=(const quadric_t& q)
+	{
+		for (int i = 0; i < 10; i++)
+			m[i] += q.m[i];
+		return *this;
+	}
+	double error(const Vec3f& v) const
+	{
+		double x = v.x, y = v.y, z = v.z;
+		return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x
+			+ m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y
+			+ m[7] * z * z + 2 * m[8] * z + m[9];
+	}
+	bool optimum(Vec3f& v) const//solves the 3x3 system, false when it is singular
+	{
+		double det = m[0] * (m[4] * m[7] - m[5] * m[5]) - m[1] * (m[1] * m[7] - m[5] * m[2]) + m[2] * (m[1] * m[5] - m[4] * m[2]);
+		if (std::fabs(det) < 1e-12)
+			return false;
+		double bx = -m[3], by = -m[6], bz = -m[8];
+		v.x = float((bx * (m[4] * m[7] - m[5] * m[5]) - m[1] * (by * m[7] - m[5] * bz) + m[2] * (by * m[5] - m[4] * bz)) / det);
+		v.y = float((m[0] * (by * m[7] - m[5] * bz) - bx * (m[1] * m[7] - m[5] * m[2]) + m[2] * (m[1] * bz - by * m[2])) / det);
+		v.z = float((m[0] * (m[4] * bz - by * m[5]) - m[1] * (m[1] * bz - by * m[2]) + bx * (m[1] * m[5] - m[4] * m[2])) / det);
+		return true;
+	}
+};
+
+struct collapse_t
+{
+	double cost;
+	int v1, v2;
+	unsigned stamp1, stamp2;//vertex stamps at push time, the entry is stale once either vertex changed
+	Vec3f pos;
+	bool operator<(const collapse_t& c) const { return cost > c.cost; }//cheapest on top
+};
+
+float simplify_mesh(const std::vector<Vec3f>& verts, const std::vector<Vec3i>& faces, const size_t target_faces,
+	std::vector<Vec3f>& out_verts, std::vector<Vec3i>& out_faces)
+{
+	std::vector<Vec3f> pos(verts);
+	std::vector<Vec3i> tri(faces);
+	std::vector<quadric_t> q(verts.size());
+	std::vector<std::vector<int> > vfaces(verts.size());
+	std::vector<unsigned> stamp(verts.size());
+	std::vector<bool> vdead(verts.size()), fdead(faces.size());
+	std::vector<Vec3f> fnormal(faces.size());//in the full mesh
+	Vec3f bb_min = verts[0], bb_max = verts[0];
+
+	for (size_t v = 1; v < verts.size(); v++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			bb_min[j] = std::min(bb_min[j], verts[v][j]);
+			bb_max[j] = std::max(bb_max[j], verts[v][j]);
+		}
+	}
+	for (size_t f = 0; f < tri.size(); f++)
+	{
+		Vec3f n = cross(pos[tri[f][1]] - pos[tri[f][0]], pos[tri[f][2]] - pos[tri[f][0]]);
+		if (n.norm() > 0)
+			n.normalize();
+		fnormal[f] = n;
+		double d = -(n * pos[tri[f][0]]);
+		for (int k = 0; k < 3; k++)
+		{
+			q[tri[f][k]].add_plane(n.x, n.y, n.z, d);
+			vfaces[tri[f][k]].push_back(int(f));
+		}
+	}
+
+	std::priority_queue<collapse_t> heap;
+	auto push_edge = [&](const int v1, const int v2)
+	{
+		quadric_t qe = q[v1];
+		qe += q[v2];
+		collapse_t c;
+		c.v1 = v1;
+		c.v2 = v2;
+		c.stamp1 = stamp[v1];
+		c.stamp2 = stamp[v2];
+		Vec3f mid = (pos[v1] + pos[v2]) * 0.5f;
+		if (!qe.optimum(c.pos) || (c.pos - mid).norm() > (pos[v1] - pos[v2]).norm())
+		{
+			//singular or far away optimum, take the best of the end points and the middle
+			c.pos = mid;
+			if (qe.error(pos[v1]) < qe.error(c.pos)) c.pos = pos[v1];
+			if (qe.error(pos[v2]) < qe.error(c.pos)) c.pos = pos[v2];
+		}
+		for (int j = 0; j < 3; j++)//stay inside the bounding box used by ray_bbox_intersect
+			c.pos[j] = std::max(bb_min[j], std::min(bb_max[j], c.pos[j]));
+		c.cost = qe.error(c.pos);
+		heap.push(c);
+	};
+	std::vector<std::pair<int, int> > edges;
+	for (size_t f = 0; f < tri.size(); f++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			int a = tri[f][k], b = tri[f][(k + 1) % 3];
+			edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+	edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+	for (size_t e = 0; e < edges.size(); e++)
+		push_edge(edges[e].first, edges[e].second);
+
+	size_t live_faces = tri.size();
+	double max_error = 0;
+	float max_tilt = 0;
+	while (live_faces > target_faces && !heap.empty())
+	{
+		collapse_t c = heap.top();
+		heap.pop();
+		if (vdead[c.v1] || vdead[c.v2] || stamp[c.v1] != c.stamp1 || stamp[c.v2] != c.stamp2)
+			continue;
+
+		//reject collapses that flip a face, the edge is pushed again once a neighbour changes
+		bool flips = false;
+		float tilt = 0;
+		for (int side = 0; side < 2 && !flips; side++)
+		{
+			int v = side ? c.v2 : c.v1, other = side ? c.v1 : c.v2;
+			for (size_t k = 0; k < vfaces[v].size() && !flips; k++)
+			{
+				const Vec3i& t = tri[vfaces[v][k]];
+				if (fdead[vfaces[v][k]] || t[0] == other || t[1] == other || t[2] == other)
+					continue;
+				Vec3f p[3] = { pos[t[0]], pos[t[1]], pos[t[2]] };
+				Vec3f n0 = cross(p[1] - p[0], p[2] - p[0]);
+				for (int j = 0; j < 3; j++)
+					if (t[j] == v)
+						p[j] = c.pos;
+				Vec3f n1 = cross(p[1] - p[0], p[2] - p[0]);
+				flips = n0 * n1 <= 0.2f * n0.norm() * n1.norm();
+				if (!flips && n1.norm() > 0)
+				{
+					float edge = std::max((p[1] - p[0]).norm(), std::max((p[2] - p[1]).norm(), (p[0] - p[2]).norm()));
+					tilt = std::max(tilt, edge * cross(fnormal[vfaces[v][k]], n1).norm() / n1.norm());
+				}
+			}
+		}
+		if (flips)
+			continue;
+
+		pos[c.v1] = c.pos;
+		q[c.v1] += q[c.v2];
+		vdead[c.v2] = true;
+		stamp[c.v1]++;
+		max_error = std::max(max_error, c.cost);
+		max_tilt = std::max(max_tilt, tilt);
+		for (size_t k = 0; k < vfaces[c.v2].size(); k++)
+		{
+			int f = vfaces[c.v2][k];
+			if (fdead[f])
+				continue;
+			for (int j = 0; j < 3; j++)
+				if (tri[f][j] == c.v2)
+					tri[f][j] = c.v1;
+			if (tri[f][0] == tri[f][1] || tri[f][1] == tri[f][2] || tri[f][0] == tri[f][2])
+			{
+				fdead[f] = true;
+				live_faces--;
+			}
+			else
+				vfaces[c.v1].push_back(f);
+		}
+		vfaces[c.v2].clear();
+
+		std::vector<int>& vf = vfaces[c.v1];
+		vf.erase(std::remove_if(vf.begin(), vf.end(), [&](const int f) { return fdead[f]; }), vf.end());
+		std::vector<int> neighbours;
+		for (size_t k = 0; k < vf.size(); k++)
+			for (int j = 0; j < 3; j++)
+				if (tri[vf[k]][j] != c.v1)
+					neighbours.push_back(tri[vf[k]][j]);
+		std::sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+		for (size_t k = 0; k < neighbours.size(); k++)
+			push_edge(c.v1, neighbours[k]);
+	}
+
+	std::vector<int> remap(verts.size(), -1);
+	out_verts.clear();
+	out_faces.clear();
+	for (size_t f = 0; f < tri.size(); f++)
+	{
+		if (fdead[f])
+			continue;
+		Vec3i t;
+		for (int j = 0; j < 3; j++)
+		{
+			if (remap[tri[f][j]] < 0)
+			{
+				remap[tri[f][j]] = int(out_verts.size());
+				out_verts.push_back(pos[tri[f][j]]);
+			}
+			t[j] = remap[tri[f][j]];
+		}
+		out_faces.push_back(t);
+	}
+	return std::max(float(std::sqrt(std::max(0.0, max_error))), max_tilt);
+}
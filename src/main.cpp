@@ -2,6 +2,11 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <functional>
+#include <memory>
 
 #include <chrono>
 #include <thread>
@@ -9,6 +14,9 @@
 
 #include "util.hpp"
 #include "geometry.hpp"
+#include "fastmath.hpp"
+#include "ooc.hpp"
+#include "temporal.hpp"
 
 #define SDL_MAIN_HANDLED//no SDL_main function
 #include "SDL2/SDL.h"
@@ -59,33 +67,214 @@ public:
 	}
 };
 
+struct quality_level_t
+{
+	unsigned scale;		//window pixels per internal pixel along each axis
+	unsigned max_depth;
+	unsigned spp;
+};
+
+//cheapest first, full_quality_level is what the renderer draws without a frame budget, the levels above it refine a still view
+static const quality_level_t quality_levels[] = {
+	{8, 1, 1}, {6, 1, 1}, {4, 2, 1}, {3, 2, 1}, {2, 3, 1}, {2, 4, 1}, {1, 2, 1}, {1, 4, 1}, {1, 4, 2}, {1, 4, 4}
+};
+static const int quality_levels_num = sizeof(quality_levels) / sizeof(quality_levels[0]);
+static const int full_quality_level = 7;
+static const unsigned max_accumulated_frames = 256;//a still view with sampled lights stops refining after that many frames
+
+class frame_budget_t//picks the quality of the next frame from the measured cost of the previous ones
+{
+public:
+	frame_budget_t(const double budget)
+		: budget(budget), moving_level(budget > 0 ? 0 : full_quality_level), level(moving_level)
+	{}
+	double budget;		//target seconds per frame while the camera moves, zero renders every frame at full quality
+	int moving_level;	//cheapest level that fits the budget
+	int level;			//level of the frame in flight
+
+	//returns the level of the next frame, -1 when the view is final and the workers can idle
+	int frame_done(const double frame_time)
+	{
+		if (budget > 0 && level == moving_level)
+		{
+			if (frame_time > budget && moving_level > 0)
+				moving_level--;
+			else if (frame_time < 0.5 * budget && moving_level < full_quality_level)
+				moving_level++;
+		}
+		//the camera stands still, recover quality a level per frame
+		int last = budget > 0 ? quality_levels_num - 1 : full_quality_level;
+		return level < last ? ++level : -1;
+	}
+	//the frame in flight is dropped, elapsed is how long it has been rendering
+	int camera_moved(const double elapsed)
+	{
+		if (budget > 0 && level == moving_level && elapsed > budget && moving_level > 0)
+			moving_level--;
+		return level = moving_level;
+	}
+};
+
+static void render_image(const Scene_t& scene, const frame_params_t& fp, const unsigned width, const unsigned height, const bool lod,
+	std::vector<Vec3f>& image, const int threads_num)
+{
+	image.resize(width * height);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threads_num; t++)
+	{
+		unsigned y0 = height * t / threads_num, y1 = height * (t + 1) / threads_num;
+		threads.push_back(std::thread(render_tile, std::cref(scene), std::cref(fp), width, height, 0, y0, width, y1, lod, &image[y0 * width]));
+	}
+	for (auto& t : threads)
+		t.join();
+}
+
+//renders the view with the exact and the fast math and reports the difference, fails below 40 dB PSNR
+static int math_accuracy_check(const Scene_t& scene, const unsigned width, const unsigned height, const bool lod)
+{
+	frame_params_t fp;
+	std::vector<Vec3f> exact, fast;
+	auto tp = std::chrono::high_resolution_clock::now();
+	set_fast_math(false);
+	render_image(scene, fp, width, height, lod, exact, 4);
+	double exact_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tp).count();
+	tp = std::chrono::high_resolution_clock::now();
+	set_fast_math(true);
+	render_image(scene, fp, width, height, lod, fast, 4);
+	double fast_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tp).count();
+	set_fast_math(false);
+
+	double max_err = 0, sum_sq = 0;
+	size_t off_pixels = 0;//pixels with a channel off by more than one step of 8 bit color
+	for (size_t i = 0; i < exact.size(); i++)
+	{
+		unColor_t a, b;
+		a.color = toColor(exact[i]);
+		b.color = toColor(fast[i]);
+		double pixel_err = 0;
+		const uint8_t ca[3] = { a.c.r, a.c.g, a.c.b }, cb[3] = { b.c.r, b.c.g, b.c.b };
+		for (int k = 0; k < 3; k++)
+		{
+			double e = std::abs(int(ca[k]) - int(cb[k])) / 255.;
+			pixel_err = std::max(pixel_err, e);
+			sum_sq += e * e;
+		}
+		max_err = std::max(max_err, pixel_err);
+		off_pixels += pixel_err > 1.5 / 255.;
+	}
+	double mse = sum_sq / (3. * exact.size());
+	double psnr = mse > 0 ? 10 * std::log10(1. / mse) : std::numeric_limits<double>::infinity();
+	std::cout << "exact: " << exact_time << " s, fast: " << fast_time << " s\n"
+		<< "max error: " << max_err * 255 << "/255, pixels off by more than 1/255: " << off_pixels << " of " << exact.size()
+		<< ", PSNR: " << psnr << " dB\n";
+	return psnr >= 40 ? 0 : 1;
+}
+
+//residency summary, per_cluster adds the clusters loaded most often, the ones the cache is too small for
+static void print_ooc_stats(const OocModel& ooc, const bool per_cluster)
+{
+	std::vector<ooc_cluster_stats_t> st = ooc.cluster_stats();
+	unsigned long long hits = 0, loads = 0, evictions = 0, failures = 0;
+	size_t resident = 0;
+	for (size_t c = 0; c < st.size(); c++)
+	{
+		hits += st[c].hits;
+		loads += st[c].loads;
+		evictions += st[c].evictions;
+		failures += st[c].failures;
+		resident += st[c].resident;
+	}
+	std::cout << "ooc: resident " << ooc.resident_bytes() / (1024 * 1024) << " MB, " << resident << "/" << st.size() << " clusters"
+		<< " loads: " << loads << " evictions: " << evictions
+		<< " hit rate: " << 100. * hits / double(std::max(1ull, hits + loads)) << "%"
+		<< (failures ? " failed mappings: " + std::to_string(failures) : std::string()) << "\n";
+	if (!per_cluster)
+		return;
+	std::vector<unsigned> order(st.size());
+	for (size_t c = 0; c < order.size(); c++)
+		order[c] = unsigned(c);
+	size_t n = std::min<size_t>(10, order.size());
+	std::partial_sort(order.begin(), order.begin() + n, order.end(),
+		[&](const unsigned a, const unsigned b) { return st[a].loads > st[b].loads; });
+	for (size_t k = 0; k < n; k++)
+	{
+		const ooc_cluster_stats_t& s = st[order[k]];
+		std::cout << "cluster " << order[k] << ": " << s.bytes / 1024 << " KB loads: " << s.loads
+			<< " evictions: " << s.evictions << " hits: " << s.hits << (s.resident ? " resident" : "") << "\n";
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	sdl_window_t mainWindow;
 	render_state_t r_state;
 	r_state.width = 800;
 	r_state.height = 600;
+	bool show_ray_stats = false;
+	bool math_check = false;
+	double frame_budget_ms = 0;
+	unsigned cloud_spheres = 0;
+	const char* ooc_file = nullptr;
+	size_t ooc_cache_mb = 256;
+	unsigned short server_port = 0;
+	bool use_temporal = false;
+	unsigned extra_lights = 0, light_samples = 0;
+	const char* poster_file = nullptr;
+	unsigned poster_width = 0, poster_height = 0, poster_tile = 256;
+	temporal_t temporal;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--batch")//breadth first tracing with sorted secondary rays
+			r_state.batch_rays = true;
+		else if (arg == "--nosort")//batches in generation order, to compare coherence against --batch
+			r_state.batch_rays = true, r_state.sort_rays = false;
+		else if (arg == "--lod")//trace models at the level of detail matching the pixel footprint
+			r_state.lod = true;
+		else if (arg == "--raystats")
+			show_ray_stats = true;
+		else if (arg == "--fastmath")//polynomial approximations of fastmath.hpp, F toggles it at runtime
+			set_fast_math(true);
+		else if (arg == "--mathcheck")//compares a frame rendered with the fast math against the exact one and exits
+			math_check = true;
+		else if (arg == "--spheres" && i + 1 < argc)//adds a cloud of that many small spheres
+			cloud_spheres = unsigned(atof(argv[++i]));
+		else if (arg == "--budget" && i + 1 < argc)//target frame time in ms, scales resolution, depth and spp
+			frame_budget_ms = atof(argv[++i]);
+		else if (arg == "--oocbuild" && i + 2 < argc)//converts an obj into the clustered out of core file and exits
+		{
+			Model model(argv[i + 1], false);//the conversion only reads the full mesh
+			return ooc_build(model, argv[i + 2]) ? 0 : 1;
+		}
+		else if (arg == "--ooc" && i + 1 < argc)//renders the out of core file in place of the model
+			ooc_file = argv[++i];
+		else if (arg == "--ooccache" && i + 1 < argc)//MB of clusters kept mapped
+			ooc_cache_mb = size_t(atof(argv[++i]));
+		else if (arg == "--temporal")//reuses the pixels of the previous frame that are still valid after the camera moved
+			use_temporal = true;
+		else if (arg == "--refresh" && i + 1 < argc)//with --temporal, 1 / n of the reused pixels are traced again each frame
+			temporal.refresh = std::max(1, atoi(argv[++i]));
+		else if (arg == "--lights" && i + 1 < argc)//adds that many dim point lights above the scene
+			extra_lights = unsigned(atof(argv[++i]));
+		else if (arg == "--lightsamples" && i + 1 < argc)//shadow rays per hit to lights picked from a light tree, a still view accumulates frames
+			light_samples = unsigned(atoi(argv[++i]));
+		else if (arg == "--poster" && i + 3 < argc)//renders a large image into a tiled TIFF and exits
+		{
+			poster_file = argv[++i];
+			poster_width = unsigned(atof(argv[++i]));
+			poster_height = unsigned(atof(argv[++i]));
+		}
+		else if (arg == "--tile" && i + 1 < argc)//tile size of --poster, a multiple of 16
+			poster_tile = unsigned(atoi(argv[++i]));
+		else if (arg == "--server" && i + 1 < argc)//headless, serves render requests on a local port, see server.cpp
+			server_port = (unsigned short)atoi(argv[++i]);
+	}
 
 	std::vector<unsigned> framebuffer((unsigned)r_state.width* r_state.height);
 	envmap_env_t envmap("envmap.jpg");
 	Scene_t scene(&envmap);
 	frame_counter_t frame_counter;
 	
-	SDL_SetMainReady();
-	if (SDL_Init(SDL_INIT_VIDEO))
-	{
-		std::cerr << "Couldn't initialize SDL: " << SDL_GetError() << std::endl;
-		return -1;
-	}
-	if (SDL_CreateWindowAndRenderer(r_state.width, r_state.height, SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS, &mainWindow.window, &mainWindow.renderer))
-	{
-		std::cerr << "Couldn't create window and renderer: " << SDL_GetError() << std::endl;
-		return -1;
-	}
-	mainWindow.framebuffer = SDL_CreateTexture(mainWindow.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, r_state.width, r_state.height);
-
-
-
 	Material      ivory(Vec4f(0.6f, 0.3f, 0.1f, 0.0f), Vec3f(0.4f, 0.4f, 0.3f), 50.0f, 1.0);
 	Material red_rubber(Vec4f(0.9f, 0.1f, 0.1f, 0.0f), Vec3f(0.3f, 0.1f, 0.1f), 10.0f, 1.0);
 	Material     mirror(Vec4f(0.0f, 10.0f, 0.8f, 0.0f), Vec3f(1.0f, 1.0f, 1.0f), 1425.f, 1.0);
@@ -104,26 +293,168 @@ int main(int argc, char* argv[])
 	lights.push_back(Light_t(Vec3f(-20, 20, 20), 1.5f));
 	lights.push_back(Light_t(Vec3f(30, 50, -25), 1.8f));
 	lights.push_back(Light_t(Vec3f(30, 20, 30), 1.7f));
+	{
+		unsigned seed = 7;
+		auto rnd = [&seed]() { seed = mrand_4k(seed); return seed / float(0x1000000); };
+		for (unsigned i = 0; i < extra_lights; i++)//as bright as one of the lights above all together
+			lights.push_back(Light_t(Vec3f(-15 + 30 * rnd(), 2 + 18 * rnd(), -30 + 30 * rnd()), 3.f * (0.5f + rnd()) / extra_lights));
+	}
 	for (const auto& i : lights)
 		scene.lights.push_back(&i);
+	std::unique_ptr<light_tree_t> light_tree;
+	if (light_samples)
+	{
+		light_tree.reset(new light_tree_t(scene.lights, light_samples));
+		scene.light_tree = light_tree.get();
+	}
+
+	std::unique_ptr<Model> duck_obj;
+	std::unique_ptr<OocModel> ooc_obj;
+	if (ooc_file)
+	{
+		ooc_obj.reset(new OocModel(ooc_file, ooc_cache_mb * 1024 * 1024));
+		scene.objects.push_back(ooc_obj.get());
+	}
+	else if (!server_port)//the server requests name their own model
+	{
+		duck_obj.reset(new Model("untitled.obj", r_state.lod));//"duck.obj");//
+		scene.objects.push_back(duck_obj.get());
+	}
 
-	Model duck_obj("untitled.obj");//"duck.obj");//
-	scene.objects.push_back(&duck_obj);
+	SphereCloud cloud;
+	if (cloud_spheres)
+	{
+		const unsigned palette[4] = { cloud.add_material(ivory), cloud.add_material(red_rubber), cloud.add_material(mirror), cloud.add_material(glass) };
+		unsigned seed = 1;
+		auto rnd = [&seed]() { seed = mrand_4k(seed); return seed / float(0x1000000); };
+		float radius = 0.6f * std::cbrt(12.f * 8.f * 12.f / cloud_spheres);//fills a few percent of the box
+		for (unsigned i = 0; i < cloud_spheres; i++)
+			cloud.add(Vec3f(-6 + 12 * rnd(), -4 + 8 * rnd(), -26 + 12 * rnd()), radius * (0.5f + rnd()), palette[i % 4]);
+		cloud.build();
+		scene.objects.push_back(&cloud);
+	}
+
+	if (server_port)//the requests add their model to this base scene
+		return run_server(server_port, scene, std::max(1u, std::thread::hardware_concurrency()), r_state.lod, ooc_cache_mb * 1024 * 1024);
+
+	if (poster_file)//the best quality level, as a still view is refined to
+	{
+		const quality_level_t& q = quality_levels[quality_levels_num - 1];
+		frame_params_t fp;
+		fp.width = poster_width;
+		fp.height = poster_height;
+		fp.spp = q.spp;
+		fp.max_depth = q.max_depth;
+		return render_tiled(scene, fp, poster_width, poster_height, poster_tile, std::max(1u, std::thread::hardware_concurrency()), r_state.lod, poster_file);
+	}
+
+	if (math_check)
+		return math_accuracy_check(scene, r_state.width, r_state.height, r_state.lod);
+
+	SDL_SetMainReady();
+	if (SDL_Init(SDL_INIT_VIDEO))
+	{
+		std::cerr << "Couldn't initialize SDL: " << SDL_GetError() << std::endl;
+		return -1;
+	}
+	if (SDL_CreateWindowAndRenderer(r_state.width, r_state.height, SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS, &mainWindow.window, &mainWindow.renderer))
+	{
+		std::cerr << "Couldn't create window and renderer: " << SDL_GetError() << std::endl;
+		return -1;
+	}
+	mainWindow.framebuffer = SDL_CreateTexture(mainWindow.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, r_state.width, r_state.height);
+
+
+	frame_budget_t budget(frame_budget_ms * 0.001);
+	std::chrono::high_resolution_clock::time_point frame_start;
+	bool frame_in_flight = false;
+	auto start_frame = [&](const int level, const camera_t& camera, const bool accumulate = false)
+	{
+		const quality_level_t& q = quality_levels[level];
+		//only this thread writes the params, the new frame is set up without the lock while the workers finish the old one
+		frame_params_t fp = r_state.params;
+		fp.frame_id++;
+		fp.scale = q.scale;
+		fp.width = (r_state.width + q.scale - 1) / q.scale;
+		fp.height = (r_state.height + q.scale - 1) / q.scale;
+		fp.spp = q.spp;
+		fp.max_depth = q.max_depth;
+		fp.camera = camera;
+		fp.accum = accumulate ? fp.accum + 1 : 0;
+		fp.retrace.reset();
+		std::vector<unsigned long long> reused;
+		if (use_temporal && !r_state.batch_rays && !accumulate)//queues the reused pixels like rendered ones
+			fp.retrace = temporal.start_frame(fp, r_state.width, r_state.height, fast_math_enabled(), reused);
+
+		std::lock_guard<std::mutex> lock(r_state.mx);
+		r_state.params = fp;
+		r_state.accum.resize(size_t(fp.width) * fp.height);
+		r_state.pixels.swap(reused);//pixels of the replaced frame are dropped
+		r_state.surfaces.clear();
+		r_state.pixels_cnt = 0;
+		for (size_t k = 0; k < r_state.pixels.size(); k++)//the reused colors start the sums the next accumulated frames add to
+		{
+			unColor_t c;
+			c.color = unsigned(r_state.pixels[k]);
+			r_state.accum[size_t(r_state.pixels[k] >> 32)] = Vec3f(c.c.r + 0.5f, c.c.g + 0.5f, c.c.b + 0.5f) * (1.f / 255.f);
+		}
+		r_state.cv.notify_all();
+		frame_start = std::chrono::high_resolution_clock::now();
+		frame_in_flight = true;
+	};
+	camera_t camera;
+	start_frame(budget.level, camera);
 
 	//render_state1.pwindow = &mainWindow;
 	r_state.workers_num = 4;
 	for (int i = 0; i < r_state.workers_num; i++)
 		r_threads.push_back( std::thread(render2, &scene, &r_state, i) );
 
-	for (uint64_t frame_cnt = 0; ; )
+	const int event_timeout = frame_budget_ms > 0 ? std::max(1, std::min(34, int(frame_budget_ms / 2))) : 34;
+	for (bool quit = false; !quit; )
 	{
-		SDL_WaitEventTimeout(&mainWindow.event, 34);//34ms time out, leads to 32 fps
-		if (mainWindow.event.type == SDL_QUIT) {
-			break;
+		bool camera_moved = false;
+		//34ms time out, leads to 32 fps
+		for (int ev = SDL_WaitEventTimeout(&mainWindow.event, event_timeout); ev && !quit; ev = SDL_PollEvent(&mainWindow.event))
+		{
+			if (mainWindow.event.type == SDL_QUIT)
+				quit = true;
+			else if (mainWindow.event.type == SDL_KEYDOWN)
+			{
+				const float step = 0.5f, turn = 0.05f;
+				Vec3f forward = camera.rotate(Vec3f(0, 0, -1)), right = camera.rotate(Vec3f(1, 0, 0));
+				camera_t c = camera;
+				switch (mainWindow.event.key.keysym.sym)
+				{
+				case SDLK_w: c.position = c.position + forward * step; break;
+				case SDLK_s: c.position = c.position - forward * step; break;
+				case SDLK_d: c.position = c.position + right * step; break;
+				case SDLK_a: c.position = c.position - right * step; break;
+				case SDLK_e: c.position.y += step; break;
+				case SDLK_q: c.position.y -= step; break;
+				case SDLK_LEFT: c.yaw += turn; break;
+				case SDLK_RIGHT: c.yaw -= turn; break;
+				case SDLK_UP: c.pitch += turn; break;
+				case SDLK_DOWN: c.pitch -= turn; break;
+				case SDLK_f:
+					set_fast_math(!fast_math_enabled());
+					std::cout << (fast_math_enabled() ? "fast math\n" : "exact math\n");
+					camera_moved = true;//render the view again
+					break;
+				}
+				camera_moved |= c != camera;
+				camera = c;
+			}
 		}
+		if (quit)
+			break;
 		frame_counter.frame_begin();
-		
+
+		if (camera_moved)
+			start_frame(budget.camera_moved(frame_in_flight ? std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - frame_start).count() : 0), camera);
+
 		r_state.mx.lock();
+		const frame_params_t fp = r_state.params;
 		for (int i = 0; r_state.pixels.size() != 0 ; i++)
 		{
 			unsigned long long packed_pixel = r_state.pixels.back();
@@ -131,16 +462,31 @@ int main(int argc, char* argv[])
 			r_state.pixels_cnt++;
 			unsigned int pixcolor = packed_pixel & 0xffffffff;
 			unsigned int pixindex = packed_pixel >> 32;
-			framebuffer[pixindex] = pixcolor;
+			if (fp.retrace)
+				temporal.store_color(pixindex, pixcolor);
+			//upscale, internal pixel covers a scale x scale block of the window
+			unsigned x0 = pixindex % fp.width * fp.scale, y0 = pixindex / fp.width * fp.scale;
+			for (unsigned y = y0; y < std::min(y0 + fp.scale, r_state.height); y++)
+				for (unsigned x = x0; x < std::min(x0 + fp.scale, r_state.width); x++)
+					framebuffer[x + y * r_state.width] = pixcolor;
 		}
+		for (size_t i = 0; i < r_state.surfaces.size(); i++)
+			temporal.store_surface(r_state.surfaces[i].first, r_state.surfaces[i].second);
+		r_state.surfaces.clear();
+		bool frame_done = frame_in_flight && r_state.pixels_cnt >= fp.width * fp.height;
+		double progress = double(r_state.pixels_cnt) / double(fp.width * fp.height);
 		r_state.mx.unlock();
 		SDL_UpdateTexture(mainWindow.framebuffer, NULL, reinterpret_cast<void*>(framebuffer.data()), r_state.width * 4);
 
-			
-		if (r_state.pixels_cnt >= r_state.width * r_state.height)
+		if (frame_done)
 		{
 			frame_counter.frame++;
-			r_state.pixels_cnt -= r_state.width * r_state.height;
+			frame_in_flight = false;
+			int level = budget.frame_done(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - frame_start).count());
+			if (level >= 0)
+				start_frame(level, camera);
+			else if (scene.light_tree && r_state.params.accum + 1 < max_accumulated_frames)
+				start_frame(budget.level, camera, true);//another set of light samples for the still view
 		}
 	
 		SDL_RenderClear(mainWindow.renderer);
@@ -155,7 +501,7 @@ int main(int argc, char* argv[])
 			unsigned frame_cnt = unsigned(frame_counter.frame - frame_counter.frame_last_fps);
 			if (frame_cnt < 1)
 			{
-				fps = double(r_state.pixels_cnt) / double(r_state.width * r_state.height * frame_counter.sum_time);
+				fps = frame_in_flight ? progress / frame_counter.sum_time : 0.0;
 			}
 			else
 			{
@@ -163,7 +509,26 @@ int main(int argc, char* argv[])
 				frame_counter.sum_time = 0;
 				frame_counter.frame_last_fps = frame_counter.frame;
 			}
-			std::cout << "FPS: " << fps << "\n";
+			std::cout << "FPS: " << fps << " scale: " << fp.scale << " spp: " << fp.spp << " depth: " << fp.max_depth << "\n";
+			if (show_ray_stats && r_state.batch_rays)
+			{
+				std::lock_guard<std::mutex> lock(r_state.mx);
+				const ray_sort_stats_t& st = r_state.ray_stats;
+				double rays = double(std::max(1ull, st.rays));
+				std::cout << "rays: " << st.rays << " batches: " << st.batches
+					<< " coherent unsorted: " << 100. * st.coherent_unsorted / rays << "%"
+					<< " sorted: " << 100. * st.coherent_sorted / rays << "%"
+					<< " Mrays/s per worker: " << 1e-6 * st.rays / std::max(1e-9, st.trace_time) << "\n";
+				r_state.ray_stats = ray_sort_stats_t();
+			}
+			if (use_temporal && temporal.reused + temporal.traced)
+			{
+				std::cout << "temporal reuse: " << 100. * temporal.reused / double(temporal.reused + temporal.traced) << "% of "
+					<< temporal.reused + temporal.traced << " pixels\n";
+				temporal.reused = temporal.traced = 0;
+			}
+			if (show_ray_stats && ooc_obj)
+				print_ooc_stats(*ooc_obj, false);
 			frame_counter.show_time = 0;
 		}
 	}
@@ -172,10 +537,15 @@ int main(int argc, char* argv[])
 	SDL_DestroyWindow(mainWindow.window);
 	SDL_Quit();
 
+	r_state.mx.lock();
 	r_state.terminate = true;
+	r_state.cv.notify_all();
+	r_state.mx.unlock();
 	for (auto &i : r_threads)
 	{
 		i.join();
 	}
+	if (ooc_obj)
+		print_ooc_stats(*ooc_obj, true);
 	return 0;
 }
\ No newline at end of file
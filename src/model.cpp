@@ -7,8 +7,10 @@
 
 #include "util.hpp"
 
+static const float lod_footprint_fraction = 0.1f;//error allowed in a level, as a fraction of the pixel footprint: glossy and glass models magnify it
+
 // fills verts and faces arrays, supposes .obj file to have "f " entries without slashes
-Model::Model(const char *filename) : verts(), faces()
+Model::Model(const char *filename, const bool with_lods) : verts(), faces()
 {
     std::ifstream in;
     in.open (filename, std::ifstream::in);
@@ -60,8 +62,52 @@ Model::Model(const char *filename) : verts(), faces()
         }
     }
     std::cerr << "# v# " << verts.size() << " f# "  << faces.size() << std::endl;
+	for (size_t f = 0; f < faces.size(); f++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			if (faces[f][k] < 0 || faces[f][k] >= int(verts.size()))
+			{
+				std::cerr << "Face " << f << " has a vertex out of range in " << filename << std::endl;
+				throw std::string("Face vertex out of range in ") + filename;
+			}
+		}
+	}
+	if (verts.empty())
+		return;//no geometry, nfaces() is zero
 
 	calc_bbox();
+	if (with_lods)
+		build_lods();
+}
+
+void Model::build_lods()
+{
+	const size_t min_faces = 64;
+	lods.clear();
+	for (size_t target = faces.size() / 4; target >= min_faces; target /= 4)
+	{
+		lod_t lod;
+		lod.error = simplify_mesh(verts, faces, target, lod.verts, lod.faces);
+		size_t prev_faces = lods.empty() ? faces.size() : lods.back().faces.size();
+		if (lod.faces.size() * 10 > prev_faces * 9)//flips stop the collapses, no point in a level this close to the previous
+			break;
+		std::cerr << "lod " << lods.size() + 1 << " f# " << lod.faces.size() << " error " << lod.error << std::endl;
+		lods.push_back(lod);
+	}
+}
+
+int Model::select_lod(const Vec3f& orig, const ray_cone_t& cone) const
+{
+	if (lods.empty() || cone.spread <= 0)
+		return 0;
+	Vec3f center = (bb_min + bb_max) * 0.5f;
+	float radius = (bb_max - center).norm();
+	float footprint = cone.at(std::max(0.f, (center - orig).norm() - radius)).width;//at the nearest point of the bounding sphere
+	int level = 0;
+	while (level < int(lods.size()) && lods[level].error <= lod_footprint_fraction * footprint)
+		level++;
+	return level;
 }
 
 void Model::calc_bbox()
@@ -127,8 +173,11 @@ bool Model::ray_triangle_intersect(const int fi, const Vec3f& orig, const Vec3f&
 	return RayIntersectsTriangle(orig, dir, tnear, verts[faces[fi][0]], verts[faces[fi][1]], verts[faces[fi][2]] );
 }
 
-bool Model::ray_intersect(const Vec3f& orig, const Vec3f& dir, float &dist, Vec3f& N, Material& material) const
+bool Model::ray_intersect(const Vec3f& orig, const Vec3f& dir, float &dist, Vec3f& N, Material& material, const ray_cone_t& cone) const
 {
+	int level = select_lod(orig, cone);
+	const std::vector<Vec3f>& verts = level ? lods[level - 1].verts : this->verts;
+	const std::vector<Vec3i>& faces = level ? lods[level - 1].faces : this->faces;
 	bool intersect = false;
 	for (int i = 0; i < faces.size(); i++)
 	{
@@ -0,0 +1,453 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "ooc.hpp"
+#include "bvh.hpp"
+
+/*
+	File layout: header, clusters, top level nodes, cluster table.
+	A cluster is its BVH nodes followed by its triangles in leaf order, it starts at a 64 byte boundary
+	so the nodes inside a mapped view stay aligned. Mappings have to start at a multiple of the
+	page size (allocation granularity on Windows), a view starts at the cluster offset rounded down to it.
+*/
+
+struct ooc_header_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t cluster_count;
+	uint32_t top_count;
+	uint32_t reserved;
+	uint64_t top_offset;
+	uint64_t table_offset;
+};
+
+static const char ooc_magic[8] = { 'S', 'R', 'T', 'O', 'O', 'C', 0, 0 };
+static const uint32_t ooc_version = 1;
+static const unsigned ooc_leaf_tris = 4;
+static const unsigned ooc_cluster_align = 64;
+
+//box of triangle i, 9 floats each, for bvh_build
+static void triangle_bounds(const std::vector<float>& tris, const unsigned i, Vec3f& lo, Vec3f& hi)
+{
+	const float* t = &tris[size_t(i) * 9];
+	for (int j = 0; j < 3; j++)
+	{
+		lo[j] = std::min(t[j], std::min(t[3 + j], t[6 + j]));
+		hi[j] = std::max(t[j], std::max(t[3 + j], t[6 + j]));
+	}
+}
+
+static void set_inner(OocModel::node_t& inner, const int axis)
+{
+	inner.count = 0;
+	inner.axis = uint16_t(axis);
+}
+
+bool ooc_build(const Model& model, const char* file_name, const unsigned cluster_tris)
+{
+	std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		std::cerr << "Failed to create " << file_name << std::endl;
+		return false;
+	}
+	std::vector<float> tris(size_t(model.nfaces()) * 9);
+	for (int f = 0; f < model.nfaces(); f++)
+		for (int k = 0; k < 3; k++)
+			for (int j = 0; j < 3; j++)
+				tris[size_t(f) * 9 + k * 3 + j] = model.point(model.vert(f, k))[j];
+	std::vector<unsigned> idx(model.nfaces());
+	std::iota(idx.begin(), idx.end(), 0u);
+
+	ooc_header_t header = {};
+	memcpy(header.magic, ooc_magic, sizeof(ooc_magic));
+	header.version = ooc_version;
+	out.write((const char*)&header, sizeof(header));
+
+	std::vector<OocModel::node_t> top;
+	std::vector<OocModel::cluster_t> table;
+	std::vector<OocModel::node_t> local;
+	std::vector<float> local_tris;
+	uint64_t offset = sizeof(header);
+	if (!idx.empty())
+	{
+		bvh_build(top, idx, 0, unsigned(idx.size()), std::max(cluster_tris, ooc_leaf_tris),
+			[&](const unsigned i, Vec3f& lo, Vec3f& hi) { triangle_bounds(tris, i, lo, hi); },
+			[&](OocModel::node_t& leaf, const unsigned first, const unsigned count)
+		{
+			//the cluster treelet, triangles copied so the cluster is self contained
+			local_tris.assign(size_t(count) * 9, 0.f);
+			for (unsigned k = 0; k < count; k++)
+				memcpy(&local_tris[size_t(k) * 9], &tris[size_t(idx[first + k]) * 9], 9 * sizeof(float));
+			std::vector<unsigned> lidx(count);
+			std::iota(lidx.begin(), lidx.end(), 0u);
+			local.clear();
+			bvh_build(local, lidx, 0, count, ooc_leaf_tris,
+				[&](const unsigned i, Vec3f& lo, Vec3f& hi) { triangle_bounds(local_tris, i, lo, hi); },
+				[](OocModel::node_t& n, const unsigned f, const unsigned c)
+			{
+				n.offset = f;
+				n.count = uint16_t(c);
+			}, set_inner);
+
+			uint64_t aligned = (offset + ooc_cluster_align - 1) / ooc_cluster_align * ooc_cluster_align;
+			const char pad[ooc_cluster_align] = {};
+			out.write(pad, std::streamsize(aligned - offset));
+			OocModel::cluster_t cl;
+			cl.offset = aligned;
+			cl.node_count = uint32_t(local.size());
+			cl.bytes = uint32_t(local.size() * sizeof(OocModel::node_t) + size_t(count) * 9 * sizeof(float));
+			out.write((const char*)&local[0], std::streamsize(local.size() * sizeof(OocModel::node_t)));
+			for (unsigned k = 0; k < count; k++)
+				out.write((const char*)&local_tris[size_t(lidx[k]) * 9], 9 * sizeof(float));
+			offset = aligned + cl.bytes;
+
+			leaf.offset = uint32_t(table.size());
+			leaf.count = 1;
+			table.push_back(cl);
+		}, set_inner);
+	}
+	header.cluster_count = uint32_t(table.size());
+	header.top_count = uint32_t(top.size());
+	header.top_offset = offset;
+	header.table_offset = offset + top.size() * sizeof(OocModel::node_t);
+	if (!top.empty())
+		out.write((const char*)&top[0], std::streamsize(top.size() * sizeof(OocModel::node_t)));
+	if (!table.empty())
+		out.write((const char*)&table[0], std::streamsize(table.size() * sizeof(OocModel::cluster_t)));
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+	if (!out)
+	{
+		std::cerr << "Failed to write " << file_name << std::endl;
+		return false;
+	}
+	std::cerr << "ooc: " << model.nfaces() << " triangles in " << table.size() << " clusters, "
+		<< header.table_offset / (1024 * 1024) << " MB" << std::endl;
+	return true;
+}
+
+OocModel::OocModel(const char* file_name, const size_t cache_bytes)
+	: material(Vec4f(0.3, 1.5, 0.2, 0.5), Vec3f(.20, .21, .2), 125., 1.5), top(), table(), slots(), stats(),
+	mapped_bytes(), lru_head(-1), lru_tail(-1), cache_bytes(cache_bytes), granularity(), file(-1), mapping(-1)
+{
+	std::ifstream in(file_name, std::ios::binary);
+	ooc_header_t header;
+	if (!in.read((char*)&header, sizeof(header)) || memcmp(header.magic, ooc_magic, sizeof(ooc_magic)) || header.version != ooc_version)
+	{
+		std::cerr << "Failed to open " << file_name << std::endl;
+		return;
+	}
+	//the counts of a corrupt header must not size the allocations
+	in.seekg(0, std::ios::end);
+	const uint64_t file_size = uint64_t(in.tellg());
+	if (header.top_offset > file_size ||
+		(file_size - header.top_offset) / sizeof(node_t) < header.top_count ||
+		(file_size - header.top_offset - header.top_count * sizeof(node_t)) / sizeof(cluster_t) < header.cluster_count)
+	{
+		std::cerr << "Corrupt header in " << file_name << std::endl;
+		return;
+	}
+	top.resize(header.top_count);
+	table.resize(header.cluster_count);
+	in.seekg(std::streamoff(header.top_offset));
+	if (!top.empty())
+		in.read((char*)&top[0], std::streamsize(top.size() * sizeof(node_t)));
+	if (!table.empty())
+		in.read((char*)&table[0], std::streamsize(table.size() * sizeof(cluster_t)));
+	if (!in || !index_valid(file_size))
+	{
+		std::cerr << "Cannot read file: " << file_name << std::endl;
+		top.clear();
+		table.clear();
+		return;
+	}
+
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	granularity = si.dwAllocationGranularity;
+	HANDLE f = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	HANDLE m = f != INVALID_HANDLE_VALUE ? CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (m)
+	{
+		file = intptr_t(f);
+		mapping = intptr_t(m);
+	}
+	else if (f != INVALID_HANDLE_VALUE)
+		CloseHandle(f);
+#else
+	granularity = size_t(sysconf(_SC_PAGESIZE));
+	file = open(file_name, O_RDONLY);
+#endif
+	if (file == -1)
+	{
+		std::cerr << "Failed to map " << file_name << std::endl;
+		top.clear();
+		table.clear();
+		return;
+	}
+	slots.resize(table.size());
+	stats.resize(table.size());
+	for (size_t c = 0; c < table.size(); c++)
+		stats[c].bytes = table[c].bytes;
+	std::cerr << "ooc: " << file_name << ", " << table.size() << " clusters, "
+		<< (top.size() * sizeof(node_t) + table.size() * (sizeof(cluster_t) + sizeof(slot_t) + sizeof(ooc_cluster_stats_t))) / 1024 << " KB resident index" << std::endl;
+}
+
+//every top level child and cluster inside its array and every cluster inside the file, traversal trusts them
+bool OocModel::index_valid(const uint64_t file_size) const
+{
+	for (size_t n = 0; n < top.size(); n++)
+	{
+		const node_t& node = top[n];
+		if (node.count ? node.offset >= table.size() : (node.offset <= n || node.offset >= top.size() || node.axis > 2))
+			return false;
+	}
+	for (size_t c = 0; c < table.size(); c++)
+	{
+		const cluster_t& cl = table[c];
+		uint64_t nodes_bytes = uint64_t(cl.node_count) * sizeof(node_t);
+		if (cl.offset > file_size || cl.bytes > file_size - cl.offset || !cl.node_count || nodes_bytes > cl.bytes ||
+			(cl.bytes - nodes_bytes) % (9 * sizeof(float)))
+			return false;
+	}
+	return true;
+}
+
+OocModel::~OocModel()
+{
+	for (size_t c = 0; c < slots.size(); c++)
+		if (slots[c].view)
+			unmap(int(c));
+#ifdef _WIN32
+	if (mapping != -1)
+		CloseHandle(HANDLE(mapping));
+	if (file != -1)
+		CloseHandle(HANDLE(file));
+#else
+	if (file != -1)
+		close(int(file));
+#endif
+}
+
+void OocModel::lru_unlink(const int c) const
+{
+	slot_t& s = slots[c];
+	(s.prev >= 0 ? slots[s.prev].next : lru_head) = s.next;
+	(s.next >= 0 ? slots[s.next].prev : lru_tail) = s.prev;
+	s.prev = s.next = -1;
+}
+
+void OocModel::lru_push_front(const int c) const
+{
+	slot_t& s = slots[c];
+	s.prev = -1;
+	s.next = lru_head;
+	(lru_head >= 0 ? slots[lru_head].prev : lru_tail) = c;
+	lru_head = c;
+}
+
+void OocModel::unmap(const int c) const
+{
+	slot_t& s = slots[c];
+#ifdef _WIN32
+	UnmapViewOfFile(s.view);
+#else
+	munmap(s.view, s.view_size);
+#endif
+	mapped_bytes -= s.view_size;
+	s.view = nullptr;
+	s.data = nullptr;
+	s.view_size = 0;
+}
+
+//maps the cluster in when it is not resident and pins it, nullptr when mapping fails
+const char* OocModel::acquire(const unsigned cluster) const
+{
+	std::lock_guard<std::mutex> lock(mx);
+	slot_t& s = slots[cluster];
+	if (s.data)
+	{
+		stats[cluster].hits++;
+		if (lru_head != int(cluster))
+		{
+			lru_unlink(int(cluster));
+			lru_push_front(int(cluster));
+		}
+		s.pins++;
+		return s.data;
+	}
+
+	const cluster_t& cl = table[cluster];
+	uint64_t base = cl.offset / granularity * granularity;
+	size_t size = size_t(cl.offset - base) + cl.bytes;
+#ifdef _WIN32
+	void* view = MapViewOfFile(HANDLE(mapping), FILE_MAP_READ, DWORD(base >> 32), DWORD(base & 0xffffffff), size);
+	if (!view)
+	{
+		map_failed(cluster, unsigned(GetLastError()));
+		return nullptr;
+	}
+#else
+	void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, int(file), off_t(base));
+	if (view == MAP_FAILED)
+	{
+		map_failed(cluster, unsigned(errno));
+		return nullptr;
+	}
+	madvise(view, size, MADV_WILLNEED);//the whole cluster is about to be traversed, read it ahead
+#endif
+	s.view = view;
+	s.view_size = size;
+	s.data = (const char*)view + (cl.offset - base);
+	s.pins = 1;
+	mapped_bytes += size;
+	stats[cluster].loads++;
+	lru_push_front(int(cluster));
+
+	//evict the least recently used clusters no ray is traversing
+	for (int c = lru_tail; c >= 0 && mapped_bytes > cache_bytes;)
+	{
+		int prev = slots[c].prev;
+		if (!slots[c].pins)
+		{
+			lru_unlink(c);
+			unmap(c);
+			stats[c].evictions++;
+		}
+		c = prev;
+	}
+	return s.data;
+}
+
+//the cluster is left out of the rays that reach it, reported on its first failure so the holes are explained
+void OocModel::map_failed(const unsigned cluster, const unsigned error) const
+{
+	if (!stats[cluster].failures++)
+		std::cerr << "ooc: failed to map cluster " << cluster << " (" << table[cluster].bytes << " bytes at " << table[cluster].offset
+			<< "), error " << error << ", its triangles are missing" << std::endl;
+}
+
+void OocModel::release(const unsigned cluster) const
+{
+	std::lock_guard<std::mutex> lock(mx);
+	slots[cluster].pins--;
+}
+
+size_t OocModel::resident_bytes() const
+{
+	std::lock_guard<std::mutex> lock(mx);
+	return mapped_bytes;
+}
+
+std::vector<ooc_cluster_stats_t> OocModel::cluster_stats() const
+{
+	std::lock_guard<std::mutex> lock(mx);
+	std::vector<ooc_cluster_stats_t> r(stats);
+	for (size_t c = 0; c < r.size(); c++)
+		r[c].resident = slots[c].data != nullptr;
+	return r;
+}
+
+bool OocModel::cluster_intersect(const char* data, const cluster_t& cl, const Vec3f& orig, const Vec3f& dir, const float* inv, float& dist, Vec3f& N) const
+{
+	const node_t* nodes = (const node_t*)data;
+	const float* tris = (const float*)(data + cl.node_count * sizeof(node_t));
+	const size_t tri_count = (cl.bytes - cl.node_count * sizeof(node_t)) / (9 * sizeof(float));
+	bool intersect = false;
+	unsigned stack[64];
+	unsigned sp = 0;
+	stack[sp++] = 0;
+	while (sp)
+	{
+		unsigned ni = stack[--sp];
+		const node_t& node = nodes[ni];
+		if (!bvh_box_hit(node, orig, inv, dist))
+			continue;
+		if (node.count)
+		{
+			if (size_t(node.offset) + node.count > tri_count)
+				continue;//corrupt cluster, the mapping ends there
+			for (unsigned k = node.offset; k < node.offset + node.count; k++)
+			{
+				const float* t = tris + size_t(k) * 9;
+				Vec3f v0(t[0], t[1], t[2]), v1(t[3], t[4], t[5]), v2(t[6], t[7], t[8]);
+				float cur_dist;
+				if (RayIntersectsTriangle(orig, dir, cur_dist, v0, v1, v2) && cur_dist < dist)
+				{
+					dist = cur_dist;
+					intersect = true;
+					N = cross(v1 - v0, v2 - v0).normalize();
+				}
+			}
+			continue;
+		}
+		if (node.offset <= ni || node.offset >= cl.node_count || node.axis > 2 || sp + 2 > 64)
+			continue;
+		unsigned left = ni + 1, right = node.offset;
+		if (dir[node.axis] < 0)
+			std::swap(left, right);
+		stack[sp++] = right;
+		stack[sp++] = left;
+	}
+	return intersect;
+}
+
+bool OocModel::ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material) const
+{
+	if (top.empty())
+		return false;
+	float inv[3];
+	for (int j = 0; j < 3; j++)
+		inv[j] = 1.f / dir[j];
+
+	bool intersect = false;
+	unsigned stack[64];
+	unsigned sp = 0;
+	stack[sp++] = 0;
+	while (sp)
+	{
+		unsigned ni = stack[--sp];
+		const node_t& node = top[ni];
+		if (!bvh_box_hit(node, orig, inv, dist))
+			continue;
+		if (node.count)
+		{
+			const char* data = acquire(node.offset);
+			if (!data)
+				continue;
+			intersect |= cluster_intersect(data, table[node.offset], orig, dir, inv, dist, N);
+			release(node.offset);
+			continue;
+		}
+		if (sp + 2 > 64)
+			continue;//deeper than the median split of a valid file gets
+		unsigned left = ni + 1, right = node.offset;
+		if (dir[node.axis] < 0)
+			std::swap(left, right);
+		stack[sp++] = right;
+		stack[sp++] = left;
+	}
+	if (intersect)
+		material = this->material;
+	return intersect;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "geometry.hpp"
+#include "util.hpp"
+
+/*
+	Out of core mesh.
+	ooc_build splits a mesh into clusters of spatially close triangles, each cluster is a treelet:
+	a small BVH with its own copy of the triangle vertices, written to a file at its own offset.
+	OocModel keeps only the top level BVH over the clusters and the cluster table in memory,
+	clusters are memory mapped when a ray reaches them and unmapped again by a LRU cache
+	once the mapped bytes exceed the budget, so resident memory stays bounded by the budget.
+*/
+
+//in ooc.cpp, returns false on i/o errors
+bool ooc_build(const Model& model, const char* file_name, const unsigned cluster_tris = 4096);
+
+struct ooc_cluster_stats_t
+{
+	ooc_cluster_stats_t()
+		: hits(), loads(), evictions(), failures(), bytes(), resident(false)
+	{}
+	unsigned long long hits;		//acquired while resident
+	unsigned long long loads;		//mapped in
+	unsigned long long evictions;	//unmapped by the cache
+	unsigned long long failures;	//mappings that failed, rays missed the cluster
+	unsigned bytes;
+	bool resident;
+};
+
+class OocModel : public SceneObject_t
+{
+public:
+	struct node_t//top level and cluster BVH node, the left child follows its parent
+	{
+		float bb_min[3], bb_max[3];
+		uint32_t offset;	//inner: right child, top level leaf: cluster, cluster leaf: first triangle
+		uint16_t count;		//zero for inner nodes, 1 for top level leaves, triangles in cluster leaves
+		uint16_t axis;
+	};
+	struct cluster_t
+	{
+		uint64_t offset;	//in the file
+		uint32_t bytes;
+		uint32_t node_count;//followed by the triangles, 9 floats each
+	};
+
+	OocModel(const char* file_name, const size_t cache_bytes);
+	~OocModel();
+
+	bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material) const;
+
+	size_t resident_bytes() const;
+	std::vector<ooc_cluster_stats_t> cluster_stats() const;
+	size_t clusters() const { return table.size(); }
+	Material material;
+private:
+	struct slot_t
+	{
+		slot_t()
+			: view(), view_size(), data(), pins(), prev(-1), next(-1)
+		{}
+		void* view;			//mapping, starts at the offset rounded down to the mapping granularity
+		size_t view_size;
+		const char* data;	//cluster inside the view
+		unsigned pins;		//rays traversing the cluster, not evictable while nonzero
+		int prev, next;		//LRU list of mapped clusters
+	};
+	std::vector<node_t> top;
+	std::vector<cluster_t> table;
+	mutable std::vector<slot_t> slots;
+	mutable std::vector<ooc_cluster_stats_t> stats;
+	mutable std::mutex mx;
+	mutable size_t mapped_bytes;
+	mutable int lru_head, lru_tail;//head is the most recently used
+	size_t cache_bytes;
+	size_t granularity;
+	intptr_t file, mapping;
+
+	const char* acquire(const unsigned cluster) const;
+	void release(const unsigned cluster) const;
+	void lru_unlink(const int c) const;
+	void lru_push_front(const int c) const;
+	void unmap(const int c) const;
+	void map_failed(const unsigned cluster, const unsigned error) const;
+	bool index_valid(const uint64_t file_size) const;
+	bool cluster_intersect(const char* data, const cluster_t& cl, const Vec3f& orig, const Vec3f& dir, const float* inv, float& dist, Vec3f& N) const;
+};
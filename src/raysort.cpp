@@ -0,0 +1,179 @@
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+#include "raysort.hpp"
+#include "fastmath.hpp"
+#include "shading.hpp"
+
+static inline Vec3f mul(const Vec3f& a, const Vec3f& b)
+{
+	return Vec3f(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+static inline unsigned expand_bits3(unsigned v)//inserts two zero bits after each of the 10 low bits
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+unsigned ray_sort_key(const Vec3f& orig, const Vec3f& dir, const Vec3f& bb_min, const Vec3f& cell_scale)
+{
+	const unsigned cell_max = (1u << ray_batch_t::cell_bits) - 1;
+	unsigned cell[3];
+	for (int i = 0; i < 3; i++)
+		cell[i] = std::min(cell_max, unsigned(std::max(0.f, (orig[i] - bb_min[i]) * cell_scale[i])));
+	unsigned octant = (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+	return (octant << (3 * ray_batch_t::cell_bits)) |
+		(expand_bits3(cell[0]) << 2) | (expand_bits3(cell[1]) << 1) | expand_bits3(cell[2]);
+}
+
+void ray_batch_t::sort_rays()
+{
+	Vec3f bb_min = rays[0].orig, bb_max = rays[0].orig;
+	for (size_t i = 1; i < rays.size(); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			bb_min[j] = std::min(bb_min[j], rays[i].orig[j]);
+			bb_max[j] = std::max(bb_max[j], rays[i].orig[j]);
+		}
+	}
+	Vec3f cell_scale;
+	for (int j = 0; j < 3; j++)
+	{
+		float extent = bb_max[j] - bb_min[j];
+		cell_scale[j] = extent > 0 ? float(1u << cell_bits) / extent : 0.f;
+	}
+
+	order.resize(rays.size());
+	for (size_t i = 0; i < rays.size(); i++)
+		order[i] = ((unsigned long long)ray_sort_key(rays[i].orig, rays[i].dir, bb_min, cell_scale) << 32) | i;
+	for (size_t i = 1; i < order.size(); i++)
+		stats.coherent_unsorted += (order[i] >> 32) == (order[i - 1] >> 32);
+	if (!sort)
+		return;
+
+	//LSD radix sort on the 32 bit key, 8 bits per pass
+	tmp_order.resize(order.size());
+	for (unsigned shift = 32; shift < 64; shift += 8)
+	{
+		size_t count[256] = {};
+		for (size_t i = 0; i < order.size(); i++)
+			count[(order[i] >> shift) & 0xff]++;
+		if (count[(order[0] >> shift) & 0xff] == order.size())
+			continue;//all keys share this digit
+		size_t sum = 0;
+		for (int d = 0; d < 256; d++)
+		{
+			size_t c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < order.size(); i++)
+			tmp_order[count[(order[i] >> shift) & 0xff]++] = order[i];
+		order.swap(tmp_order);
+	}
+	for (size_t i = 1; i < order.size(); i++)
+		stats.coherent_sorted += (order[i] >> 32) == (order[i - 1] >> 32);
+
+	tmp.resize(rays.size());
+	for (size_t i = 0; i < order.size(); i++)
+		tmp[i] = rays[order[i] & 0xffffffff];
+	rays.swap(tmp);
+}
+
+void ray_batch_t::trace(const Scene_t& scene, const Vec3f* origs, const Vec3f* dirs, size_t n, Vec3f* colors)
+{
+	rays.resize(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		rays[i] = ray_t();
+		rays[i].orig = origs[i];
+		rays[i].dir = dirs[i];
+		rays[i].weight = Vec3f(1, 1, 1);
+		rays[i].pixel = unsigned(i);
+		colors[i] = Vec3f();
+	}
+	stats.batches++;
+
+	if (fast_math_enabled())
+		trace_generations<true>(scene, colors);
+	else
+		trace_generations<false>(scene, colors);
+}
+
+template <bool FAST>
+void ray_batch_t::trace_generations(const Scene_t& scene, Vec3f* colors)
+{
+	while (!rays.empty())
+	{
+		sort_rays();
+		stats.rays += rays.size();
+		next.clear();
+
+		auto tp = std::chrono::high_resolution_clock::now();
+		for (size_t k = 0; k < rays.size(); k++)
+		{
+			const ray_t& ray = rays[k];
+			Vec3f point, N;
+			Material material;
+
+			if (ray.light_dist >= 0)
+			{
+				if (!(scene_intersect(ray.orig, ray.dir, scene, point, N, material, ray_cone_t(ray.cone_width, cone_spread)) && (point - ray.orig).norm() < ray.light_dist))
+					colors[ray.pixel] = colors[ray.pixel] + ray.weight;
+				continue;
+			}
+			if (ray.depth > max_depth || !scene_intersect(ray.orig, ray.dir, scene, point, N, material, ray_cone_t(ray.cone_width, cone_spread)))
+			{
+				colors[ray.pixel] = colors[ray.pixel] + mul(ray.weight, FAST ? envmap_color_fast(scene, ray.dir) : envmap_color(scene, ray.dir));
+				continue;
+			}
+			const float hit_cone_width = ray.cone_width + cone_spread * (point - ray.orig).norm();
+
+			//Reflections and refractions are deferred to the next generation, same terms as the shading kernels of render.cpp
+			ray_t r;
+			r.pixel = ray.pixel;
+			r.depth = ray.depth + 1;
+			r.cone_width = hit_cone_width;
+			if (material.features & MATERIAL_REFLECTIVE)
+			{
+				r.dir = math_normalize<FAST>(reflect(ray.dir, N));
+				r.orig = offset_origin(point, r.dir, N);
+				r.weight = ray.weight * material.albedo[2];
+				next.push_back(r);
+			}
+			if (material.features & MATERIAL_REFRACTIVE)
+			{
+				r.dir = math_normalize<FAST>(refract(ray.dir, N, material.refractive));
+				r.orig = offset_origin(point, r.dir, N);
+				r.weight = ray.weight * material.albedo[3];
+				next.push_back(r);
+			}
+			if (!(material.features & (MATERIAL_DIFFUSE | MATERIAL_SPECULAR)))
+				continue;
+
+			//Shadow rays carry the light contribution, added to the pixel when the light is visible
+			for_each_light(scene, point, [&](const Light_t& light, const float weight)
+			{
+				ray_t s;
+				s.weight = mul(ray.weight, light_color<FAST>(material.features, light, weight, ray.dir, point, N, material, s.dir, s.light_dist));
+				if (s.weight.x == 0 && s.weight.y == 0 && s.weight.z == 0)
+					return;//nothing to add, skip the shadow test
+				s.pixel = ray.pixel;
+				s.depth = ray.depth;
+				s.orig = offset_origin(point, s.dir, N);
+				s.cone_width = hit_cone_width;
+				next.push_back(s);
+			});
+		}
+		stats.trace_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tp).count();
+		rays.swap(next);
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "geometry.hpp"
+#include "util.hpp"
+
+/*
+	Breadth first tracing of a batch of pixels.
+	cast_ray recurses depth first, so reflection, refraction and shadow rays reach scene_intersect
+	in the order the recursion produces them. Here every generation of rays is collected into one
+	array, sorted by a compact key (direction octant, then morton code of the origin cell inside the
+	generation bounding box) with a LSD radix sort and only then intersected.
+*/
+
+struct ray_t
+{
+	ray_t()
+		: orig(), dir(), weight(), pixel(), depth(), light_dist(-1), cone_width()
+	{}
+	Vec3f orig, dir;
+	Vec3f weight;		//throughput to the owning pixel, or the light contribution for shadow rays
+	unsigned pixel;		//index into the batch colors
+	unsigned depth;
+	float light_dist;	//shadow rays only: distance to the light, negative otherwise
+	float cone_width;	//ray cone width at the origin, the spread is the same for the whole batch
+};
+
+unsigned ray_sort_key(const Vec3f& orig, const Vec3f& dir, const Vec3f& bb_min, const Vec3f& cell_scale);
+
+class ray_batch_t
+{
+public:
+	static const unsigned cell_bits = 9;//per axis, 3 * 9 bits of origin cell + 3 bits of octant
+
+	ray_batch_t()
+		: sort(true), max_depth(4), cone_spread(), stats()
+	{}
+	bool sort;
+	unsigned max_depth;	//same as the cast_ray recursion limit
+	float cone_spread;	//ray_cone_t::spread of the primary rays
+	ray_sort_stats_t stats;
+
+	//colors[i] receives the color of the primary ray (origs[i], dirs[i]), same as cast_ray
+	void trace(const Scene_t& scene, const Vec3f* origs, const Vec3f* dirs, size_t n, Vec3f* colors);
+private:
+	std::vector<ray_t> rays, next, tmp;
+	std::vector<unsigned long long> order, tmp_order;//sort key in the high half, ray index in the low
+
+	void sort_rays();
+	template <bool FAST> void trace_generations(const Scene_t& scene, Vec3f* colors);
+};
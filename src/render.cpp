@@ -1,9 +1,14 @@
 #define _USE_MATH_DEFINES
 
 #include <cmath>
+#include <atomic>
 #include <algorithm>
 #include "geometry.hpp"
 #include "util.hpp"
+#include "raysort.hpp"
+#include "fastmath.hpp"
+#include "shading.hpp"
+#include "ooc.hpp"
 
 
 bool Sphere::ray_intersect(const Vec3f& orig, const Vec3f& dir, float& t0) const
@@ -25,7 +30,7 @@ Vec3f reflect(const Vec3f& I, const Vec3f& N)
 	return I - N * 2.f * (I * N);
 }
 
-Vec3f refract(const Vec3f& I, const Vec3f& N, const float eta_t, const float eta_i = 1.f)// Snell's law
+Vec3f refract(const Vec3f& I, const Vec3f& N, const float eta_t, const float eta_i)// Snell's law
 { 
 	float cosi = -std::max(-1.f, std::min(1.f, I * N));
 	if (cosi < 0) return refract(I, -N, eta_i, eta_t); // if the ray comes from the inside the object, swap the air and the media
@@ -35,29 +40,41 @@ Vec3f refract(const Vec3f& I, const Vec3f& N, const float eta_t, const float eta
 }
 
 	
-bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene, Vec3f& hit, Vec3f& N, Material& material)
+bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene, Vec3f& hit, Vec3f& N, Material& material, const ray_cone_t& cone)
 {
-	float spheres_dist = std::numeric_limits<float>::max();
-	float model_dist = std::numeric_limits<float>::max();
+	float nearest_dist = std::numeric_limits<float>::max();//every object only takes hits in front of the nearest one so far
 	for (int j = 0; j < scene.objects.size(); j++)
 	{
 		const SceneObject_t* sc_obj = scene.objects[j];
 		const Sphere* sphere = dynamic_cast<const Sphere*>(sc_obj);
 		const Model *model = dynamic_cast<const Model*>(sc_obj);
+		const SphereCloud* cloud = dynamic_cast<const SphereCloud*>(sc_obj);
+		const OocModel* ooc = dynamic_cast<const OocModel*>(sc_obj);
 		if (sphere)
 		{
 			float dist_i;
-			if (sphere->ray_intersect(orig, dir, dist_i) && dist_i < spheres_dist)
+			if (sphere->ray_intersect(orig, dir, dist_i) && dist_i < nearest_dist)
 			{
-				spheres_dist = dist_i;
+				nearest_dist = dist_i;
 				hit = orig + dir * dist_i;
 				N = (hit - sphere->position).normalize();
 				material = sphere->material;
 			}
 		}
+		else if (cloud)
+		{
+			if (cloud->ray_intersect(orig, dir, nearest_dist, N, material))
+				hit = orig + dir * nearest_dist;
+		}
+		else if (ooc)
+		{
+			if (ooc->ray_intersect(orig, dir, nearest_dist, N, material))
+				hit = orig + dir * nearest_dist;
+		}
 		else if (model && model->ray_bbox_intersect(orig, dir) )
 		{
-			model->ray_intersect(orig, dir, model_dist, N, material);
+			if (model->ray_intersect(orig, dir, nearest_dist, N, material, cone))
+				hit = orig + dir * nearest_dist;
 		}
 	}
 
@@ -66,7 +83,7 @@ bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene,
 	{
 		float d = -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
 		Vec3f pt = orig + dir * d;
-		if (d > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && d < spheres_dist && d < model_dist)
+		if (d > 0 && fabs(pt.x) < 10 && pt.z<-10 && pt.z>-30 && d < nearest_dist)
 		{
 			checkerboard_dist = d;
 			hit = pt;
@@ -74,68 +91,264 @@ bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene,
 			material.diffuse = (int(.5 * hit.x + 1000) + int(.5 * hit.z)) & 1 ? Vec3f(.3, .3, .3) : Vec3f(.1, .1, .2);
 		}
 	}
-	return std::min(model_dist, std::min(spheres_dist, checkerboard_dist)) < 1000;
+	return std::min(nearest_dist, checkerboard_dist) < 1000;
 }
 
 
-Vec3f cast_ray(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene, size_t depth = 0)
+static std::atomic<bool> fast_math(false);
+
+bool fast_math_enabled()
 {
-	Vec3f point, N;
-	Material material;
-	const std::vector<const Light_t*>& lights = scene.lights;
-	
+	return fast_math.load(std::memory_order_relaxed);
+}
+
+void set_fast_math(const bool enable)
+{
+	fast_math.store(enable, std::memory_order_relaxed);
+}
 
-	if (depth > 4 || !scene_intersect(orig, dir, scene, point, N, material))
+
+template <bool FAST>
+static Vec3f envmap_lookup(const Scene_t& scene, const Vec3f& dir)
+{
+	size_t u, v;
+	if (FAST)
 	{
-		size_t u = scene.penvmap->width * (0.5 + atan2(dir.z, dir.x) / (2 * M_PI));
-		size_t v = scene.penvmap->height * (0.5 - asin(dir.y) / M_PI);
-		size_t i = u + v * scene.penvmap->width;//return (*envmap)[u + v * envmap_width];
-		unsigned char* pixel = scene.penvmap->pixmap;
-		return Vec3f(pixel[3 * i + 0], pixel[3 * i + 1], pixel[3 * i + 2]) * (1.f / 255.f); //background color
+		u = size_t(scene.penvmap->width * (0.5f + fast_atan2(dir.z, dir.x) * float(0.5 / M_PI)));
+		v = size_t(scene.penvmap->height * (0.5f - fast_asin(dir.y) * float(1. / M_PI)));
+		u = std::min(u, size_t(scene.penvmap->width - 1));
+		v = std::min(v, size_t(scene.penvmap->height - 1));
 	}
+	else
+	{
+		u = scene.penvmap->width * (0.5 + atan2(dir.z, dir.x) / (2 * M_PI));
+		v = scene.penvmap->height * (0.5 - asin(dir.y) / M_PI);
+	}
+	size_t i = u + v * scene.penvmap->width;//return (*envmap)[u + v * envmap_width];
+	unsigned char* pixel = scene.penvmap->pixmap;
+	return Vec3f(pixel[3 * i + 0], pixel[3 * i + 1], pixel[3 * i + 2]) * (1.f / 255.f); //background color
+}
+
+Vec3f envmap_color(const Scene_t& scene, const Vec3f& dir)
+{
+	return envmap_lookup<false>(scene, dir);
+}
+
+Vec3f envmap_color_fast(const Scene_t& scene, const Vec3f& dir)
+{
+	return envmap_lookup<true>(scene, dir);
+}
+
+template <bool FAST>
+static Vec3f trace(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t depth, size_t max_depth, const ray_cone_t& cone);
+
+//checking if the point lies in the shadow of the light
+static bool in_shadow(const Scene_t& scene, const Vec3f& point, const Vec3f& N, const Vec3f& light_dir, const float light_distance, const ray_cone_t& hit_cone)
+{
+	Vec3f shadow_orig = offset_origin(point, light_dir, N);
+	Vec3f shadow_pt, shadow_N;
+	Material tmpmaterial;
+	return scene_intersect(shadow_orig, light_dir, scene, shadow_pt, shadow_N, tmpmaterial, hit_cone) && (shadow_pt - shadow_orig).norm() < light_distance;
+}
+
+/*
+	Shading kernel specialized on the material features, F is a set of material_feature_t.
+	Terms the material does not have are removed at compile time together with their recursion,
+	a matte material does not trace reflection and refraction rays and a pure mirror no shadow rays.
+	FAST selects the approximations of fastmath.hpp.
+*/
+template <unsigned F, bool FAST>
+static Vec3f shade(const Vec3f& dir, const Scene_t& scene, const Vec3f& point, const Vec3f& N, const Material& material,
+	const size_t depth, const size_t max_depth, const ray_cone_t& hit_cone)
+{
+	Vec3f reflect_color, refract_color;
 
 	//Reflections
-	Vec3f reflect_dir = reflect(dir, N).normalize();
-	Vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // offset the original point to avoid occlusion by the object itself
-	Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, scene, depth + 1);
+	if (F & MATERIAL_REFLECTIVE)
+	{
+		Vec3f reflect_dir = math_normalize<FAST>(reflect(dir, N));
+		reflect_color = trace<FAST>(offset_origin(point, reflect_dir, N), reflect_dir, scene, depth + 1, max_depth, hit_cone);
+	}
 	//Refractions
-	Vec3f refract_dir = refract(dir, N, material.refractive).normalize();
-	Vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-	Vec3f refract_color = cast_ray(refract_orig, refract_dir, scene, depth + 1);
+	if (F & MATERIAL_REFRACTIVE)
+	{
+		Vec3f refract_dir = math_normalize<FAST>(refract(dir, N, material.refractive));
+		refract_color = trace<FAST>(offset_origin(point, refract_dir, N), refract_dir, scene, depth + 1, max_depth, hit_cone);
+	}
 
-	float diffuse_light_intensity = 0, specular_light_intensity = 0;
-	for (size_t i = 0; i < lights.size(); i++)
+	Vec3f color;
+	if (F & (MATERIAL_DIFFUSE | MATERIAL_SPECULAR))
 	{
-		Vec3f light_dir = (lights[i]->position - point).normalize();
-		float light_distance = (lights[i]->position - point).norm();
-
-		//Shadows
-		Vec3f shadow_orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // checking if the point lies in the shadow of the lights[i]
-		Vec3f shadow_pt, shadow_N;
-		Material tmpmaterial;
-		if (scene_intersect(shadow_orig, light_dir, scene, shadow_pt, shadow_N, tmpmaterial) && (shadow_pt - shadow_orig).norm() < light_distance)
-			continue;
+		for_each_light(scene, point, [&](const Light_t& light, const float weight)
+		{
+			Vec3f light_dir;
+			float light_distance;
+			Vec3f lit = light_color<FAST>(F, light, weight, dir, point, N, material, light_dir, light_distance);
+			if ((lit.x != 0 || lit.y != 0 || lit.z != 0) && !in_shadow(scene, point, N, light_dir, light_distance, hit_cone))
+				color = color + lit;
+		});
+	}
+	if (F & MATERIAL_REFLECTIVE)
+		color = color + reflect_color * material.albedo[2];
+	if (F & MATERIAL_REFRACTIVE)
+		color = color + refract_color * material.albedo[3];
+	return color;
+}
 
-		diffuse_light_intensity += lights[i]->intensity * std::max(0.f, light_dir * N);
-		specular_light_intensity += powf(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i]->intensity;
+typedef Vec3f (*shade_kernel_t)(const Vec3f& dir, const Scene_t& scene, const Vec3f& point, const Vec3f& N, const Material& material,
+	const size_t depth, const size_t max_depth, const ray_cone_t& hit_cone);
+
+static const shade_kernel_t shade_kernels[2][MATERIAL_FEATURES_ALL + 1] = {
+	{
+		shade<0, false>, shade<1, false>, shade<2, false>, shade<3, false>, shade<4, false>, shade<5, false>, shade<6, false>, shade<7, false>,
+		shade<8, false>, shade<9, false>, shade<10, false>, shade<11, false>, shade<12, false>, shade<13, false>, shade<14, false>, shade<15, false>
+	},
+	{
+		shade<0, true>, shade<1, true>, shade<2, true>, shade<3, true>, shade<4, true>, shade<5, true>, shade<6, true>, shade<7, true>,
+		shade<8, true>, shade<9, true>, shade<10, true>, shade<11, true>, shade<12, true>, shade<13, true>, shade<14, true>, shade<15, true>
 	}
+};
+
+template <bool FAST>
+static Vec3f trace(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t depth, size_t max_depth, const ray_cone_t& cone)
+{
+	Vec3f point, N;
+	Material material;
 
-	return	material.diffuse * diffuse_light_intensity * material.albedo[0] + 
-			Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1] +
-			reflect_color * material.albedo[2] + refract_color * material.albedo[3];
+	if (depth > max_depth || !scene_intersect(orig, dir, scene, point, N, material, cone))
+		return envmap_lookup<FAST>(scene, dir);
+	const ray_cone_t hit_cone = cone.at((point - orig).norm());
+
+	return shade_kernels[FAST][material.features & MATERIAL_FEATURES_ALL](dir, scene, point, N, material, depth, max_depth, hit_cone);
+}
+
+Vec3f cast_ray(const Vec3f& orig, const Vec3f& dir, const Scene_t &scene, size_t depth, size_t max_depth, const ray_cone_t& cone)
+{
+	return fast_math_enabled() ? trace<true>(orig, dir, scene, depth, max_depth, cone) : trace<false>(orig, dir, scene, depth, max_depth, cone);
+}
+
+template <bool FAST>
+static Vec3f trace_primary(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t max_depth, const ray_cone_t& cone, surface_t& surface)
+{
+	Vec3f point, N;
+	Material material;
+
+	surface = surface_t();
+	if (!scene_intersect(orig, dir, scene, point, N, material, cone))
+	{
+		surface.point = dir;
+		return envmap_lookup<FAST>(scene, dir);
+	}
+	surface.point = point;
+	surface.N = N;
+	surface.features = material.features;
+	surface.hit = true;
+	const ray_cone_t hit_cone = cone.at((point - orig).norm());
+
+	return shade_kernels[FAST][material.features & MATERIAL_FEATURES_ALL](dir, scene, point, N, material, 0, max_depth, hit_cone);
+}
+
+Vec3f cast_primary_ray(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t max_depth, const ray_cone_t& cone, surface_t& surface)
+{
+	return fast_math_enabled() ? trace_primary<true>(orig, dir, scene, max_depth, cone, surface) : trace_primary<false>(orig, dir, scene, max_depth, cone, surface);
 }
 
 
 const float fov = M_PI / 3.;
 
 
-void render2(Scene_t *scene, render_state_t *rstate, const int worker_id)
+//subpixel sample positions: pixel center for a single sample, rotated grid otherwise
+static const float sample_offsets1[1][2] = { {0.5f, 0.5f} };
+static const float sample_offsets2[2][2] = { {0.25f, 0.25f}, {0.75f, 0.75f} };
+static const float sample_offsets4[4][2] = { {0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f} };
+
+static const float* sample_offset(unsigned spp, unsigned s)
 {
-	unsigned int width = rstate->width;
-	unsigned int height = rstate->height;
-	unsigned prand_seed = 0;
+	if (spp % 4 == 0)
+		return sample_offsets4[s % 4];
+	if (spp % 2 == 0)
+		return sample_offsets2[s % 2];
+	return sample_offsets1[0];
+}
+
+camera_basis_t::camera_basis_t(const camera_t& camera, const unsigned width, const unsigned height)
+{
+	float h = tan(fov / 2.0f), w = h * width / float(height);
+	Vec3f right = camera.rotate(Vec3f(1, 0, 0)), up = camera.rotate(Vec3f(0, 1, 0)), forward = camera.rotate(Vec3f(0, 0, -1));
+	position = camera.position;
+	dx = right * (2 * w / float(width));
+	dy = up * (-2 * h / float(height));
+	corner = forward - right * w + up * h;
+}
+
+//x, y in window pixels
+static Vec3f primary_dir(const camera_basis_t& basis, float x, float y, const bool fast)
+{
+	return fast ? math_normalize<true>(basis.ray(x, y)) : math_normalize<false>(basis.ray(x, y));
+}
+
+//angle covered by an internal pixel, the ray cone spread for level of detail selection
+static float pixel_spread(const render_state_t* rstate, const frame_params_t& fp)
+{
+	return rstate->lod ? 2 * tan(fov / 2.0f) * fp.scale / float(rstate->height) : 0.f;
+}
 
 
+static const unsigned batch_size = 1024;
+
+struct batch_queue_t
+{
+	ray_batch_t batch;
+	std::vector<unsigned> indices;	//one per pixel
+	std::vector<Vec3f> origs, dirs;	//spp per pixel
+	std::vector<Vec3f> colors;
+};
+
+//adds the pixel to the sum of the frames of a still view and returns the average to display, under rstate->mx
+static unsigned accumulate(render_state_t* rstate, const frame_params_t& fp, const unsigned pixindex, const Vec3f& color)
+{
+	if (pixindex >= rstate->accum.size())
+		return toColor(color);
+	Vec3f& sum = rstate->accum[pixindex];
+	sum = fp.accum ? sum + color : color;
+	return toColor(sum * (1.f / (fp.accum + 1)));
+}
+
+//traces the collected pixels breadth first and queues them, returns false when the frame was replaced or on terminate
+static bool flush_batch(const Scene_t* scene, render_state_t* rstate, const frame_params_t& fp, batch_queue_t& q)
+{
+	q.colors.resize(q.origs.size());
+	q.batch.sort = rstate->sort_rays;
+	q.batch.max_depth = fp.max_depth;
+	q.batch.cone_spread = pixel_spread(rstate, fp);
+	q.batch.trace(*scene, q.origs.data(), q.dirs.data(), q.origs.size(), q.colors.data());
+
+	std::lock_guard<std::mutex> lock(rstate->mx);
+	bool current = rstate->params.frame_id == fp.frame_id && !rstate->terminate;
+	for (size_t k = 0; current && k < q.indices.size(); k++)
+	{
+		Vec3f color;
+		for (unsigned s = 0; s < fp.spp; s++)
+			color = color + q.colors[k * fp.spp + s];
+		rstate->pixels.push_back(((unsigned long long)q.indices[k] << 32) + accumulate(rstate, fp, q.indices[k], color * (1.f / fp.spp)));
+	}
+	rstate->ray_stats.add(q.batch.stats);
+	q.batch.stats = ray_sort_stats_t();
+	q.indices.clear();
+	q.origs.clear();
+	q.dirs.clear();
+	return current;
+}
+
+//this worker's share of the frame in prandom order, returns false when the frame was replaced or on terminate
+static bool render_frame(Scene_t* scene, render_state_t* rstate, const frame_params_t& fp, const int worker_id, batch_queue_t& q)
+{
+	unsigned int width = fp.width;
+	unsigned int height = fp.height;
+	unsigned prand_seed = 0;
+	const camera_basis_t basis(fp.camera, rstate->width, rstate->height);
+	const bool fast = fast_math_enabled();
+
 	for (unsigned p = 0; p < width * height; p += rstate->workers_num)
 	{
 		unsigned i, j;
@@ -150,22 +363,96 @@ void render2(Scene_t *scene, render_state_t *rstate, const int worker_id)
 
 		i = prand_seed % width;
 		j = (prand_seed - i) / width;
+		unsigned int pixindex = i + j * width;
+		if (fp.retrace && !(*fp.retrace)[pixindex])
+			continue;//reprojected from the previous frame
 
-		float x = (2 * (i + 0.5f) / float(width) - 1) * tan(fov / 2.0f) * width / float(height);
-		float y = -(2 * (j + 0.5f) / float(height) - 1) * tan(fov / 2.0f);
-		Vec3f dir = Vec3f(x, y, -1).normalize();
+		if (rstate->batch_rays)
+		{
+			q.indices.push_back(pixindex);
+			for (unsigned s = 0; s < fp.spp; s++)
+			{
+				const float* o = sample_offset(fp.spp, s);
+				q.origs.push_back(basis.position);
+				q.dirs.push_back(primary_dir(basis, (i + o[0]) * fp.scale, (j + o[1]) * fp.scale, fast));
+			}
+			if (q.origs.size() >= batch_size && !flush_batch(scene, rstate, fp, q))
+				return false;
+			continue;
+		}
 
-		unsigned int pixcolor = toColor(cast_ray(Vec3f(0, 0, 0), dir, *scene));
-		unsigned int pixindex = i + j * width;
-		unsigned long long packed = ((unsigned long long)pixindex << 32) + pixcolor;
+		Vec3f color;
+		surface_t surface;
+		for (unsigned s = 0; s < fp.spp; s++)
+		{
+			const float* o = sample_offset(fp.spp, s);
+			Vec3f dir = primary_dir(basis, (i + o[0]) * fp.scale, (j + o[1]) * fp.scale, fast);
+			if (fp.retrace && !s)//the first sample also records the surface for the next frame
+				color = color + cast_primary_ray(basis.position, dir, *scene, fp.max_depth, ray_cone_t(0, pixel_spread(rstate, fp)), surface);
+			else
+				color = color + cast_ray(basis.position, dir, *scene, 0, fp.max_depth, ray_cone_t(0, pixel_spread(rstate, fp)));
+		}
+		std::lock_guard<std::mutex> lock(rstate->mx);
+		if (rstate->terminate || rstate->params.frame_id != fp.frame_id)
+			return false;
+		unsigned int pixcolor = accumulate(rstate, fp, pixindex, color * (1.f / fp.spp));
+		rstate->pixels.push_back(((unsigned long long)pixindex << 32) + pixcolor);
+		if (fp.retrace)
+			rstate->surfaces.push_back(std::make_pair(pixindex, surface));
+	}
+	return q.indices.empty() || flush_batch(scene, rstate, fp, q);
+}
 
-		rstate->mx.lock();
-		rstate->pixels.push_back(packed);
-		if (rstate->terminate)
+void render2(Scene_t *scene, render_state_t *rstate, const int worker_id)
+{
+	batch_queue_t q;
+	unsigned done_frame = ~0u;
+	for (; ; )
+	{
+		frame_params_t fp;
+		{
+			std::unique_lock<std::mutex> lock(rstate->mx);
+			rstate->cv.wait(lock, [&] { return rstate->terminate || rstate->params.frame_id != done_frame; });
+			if (rstate->terminate)
+				return;
+			fp = rstate->params;
+		}
+		done_frame = fp.frame_id;
+		if (!render_frame(scene, rstate, fp, worker_id, q))
 		{
-			rstate->mx.unlock();
-			break;
+			q.indices.clear();
+			q.origs.clear();
+			q.dirs.clear();
 		}
-		rstate->mx.unlock();
 	}
 }
+
+
+void render_tile(const Scene_t& scene, const frame_params_t& fp, const unsigned width, const unsigned height,
+	const unsigned x0, const unsigned y0, const unsigned x1, const unsigned y1, const bool lod, Vec3f* colors)
+{
+	//a tile is a single pass that nothing accumulates, sampled lights would leave the noise of one frame in it
+	Scene_t all_lights;
+	if (scene.light_tree)
+	{
+		all_lights = scene;
+		all_lights.light_tree = 0;
+	}
+	const Scene_t& sc = scene.light_tree ? all_lights : scene;
+	const camera_basis_t basis(fp.camera, width, height);
+	const bool fast = fast_math_enabled();
+	const ray_cone_t cone(0, lod ? 2 * tan(fov / 2.0f) / float(height) : 0.f);
+	for (unsigned j = y0; j < y1; j++)
+	{
+		for (unsigned i = x0; i < x1; i++)
+		{
+			Vec3f color;
+			for (unsigned s = 0; s < fp.spp; s++)
+			{
+				const float* o = sample_offset(fp.spp, s);
+				color = color + cast_ray(basis.position, primary_dir(basis, i + o[0], j + o[1], fast), sc, 0, fp.max_depth, cone);
+			}
+			*colors++ = color * (1.f / fp.spp);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,415 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#else
+#include <unistd.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+#include "util.hpp"
+#include "ooc.hpp"
+
+/*
+	Render server on 127.0.0.1, one request per line, keys in any order, missing ones take the defaults:
+		render width=320 height=240 spp=1 depth=4 pos=0,0,0 yaw=0 pitch=0 model=untitled.obj envmap=envmap.jpg
+	model=<file.ooc> with the .ooc extension loads an out of core file, model=none renders the base scene alone.
+	The reply is "OK <bytes>\n" followed by a PNG of that many bytes, or "ERR <message>\n".
+	Models and environment maps stay loaded for the life of the server, the first request naming a file pays for loading it.
+	Requests from all connections are rendered by one pool of workers, bands of rows are handed out
+	round robin over the pending requests, so a small preview is not queued behind a large render.
+*/
+
+static const unsigned server_band_rows = 8;
+static const unsigned server_max_side = 8192;
+static const unsigned server_max_depth = 4;//deepest level of the interactive quality table
+
+struct server_job_t
+{
+	server_job_t()
+		: scene(), fp(), width(), height(), next_row(), rows_done(), colors()
+	{}
+	Scene_t scene;
+	frame_params_t fp;
+	unsigned width, height;
+	unsigned next_row;	//first row not handed out yet
+	unsigned rows_done;
+	std::vector<Vec3f> colors;
+};
+
+class server_pool_t
+{
+public:
+	server_pool_t(const unsigned workers_num, const bool lod)
+		: lod(lod)
+	{
+		for (unsigned i = 0; i < workers_num; i++)
+			workers.push_back(std::thread(&server_pool_t::worker, this));
+		for (auto& t : workers)
+			t.detach();//the server runs until the process is killed
+	}
+	//blocks until the whole image of the job is rendered
+	void render(server_job_t& job)
+	{
+		job.colors.resize(size_t(job.width) * job.height);
+		std::unique_lock<std::mutex> lock(mx);
+		jobs.push_back(&job);
+		cv.notify_all();
+		done_cv.wait(lock, [&job] { return job.rows_done == job.height; });
+	}
+private:
+	std::vector<std::thread> workers;
+	std::deque<server_job_t*> jobs;//jobs with rows not handed out yet
+	std::mutex mx;
+	std::condition_variable cv, done_cv;
+	const bool lod;
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock(mx);
+		for (;;)
+		{
+			cv.wait(lock, [this] { return !jobs.empty(); });
+			server_job_t* job = jobs.front();
+			jobs.pop_front();
+			unsigned y0 = job->next_row, y1 = std::min(job->height, y0 + server_band_rows);
+			job->next_row = y1;
+			if (y1 < job->height)
+				jobs.push_back(job);//the next band goes to the next job in line
+			lock.unlock();
+			render_tile(job->scene, job->fp, job->width, job->height, 0, y0, job->width, y1, lod, &job->colors[size_t(y0) * job->width]);
+			lock.lock();
+			job->rows_done += y1 - y0;
+			if (job->rows_done == job->height)
+				done_cv.notify_all();
+		}
+	}
+};
+
+//loaded once, shared by all requests; a file is loaded under the lock of its own entry,
+//requests for other files, cached or not, do not wait for it
+class asset_cache_t
+{
+public:
+	const SceneObject_t* model(const std::string& name)
+	{
+		if (name.size() > 4 && !name.compare(name.size() - 4, 4, ".ooc"))
+			return load(entry(oocs, name), name, [&] { return new OocModel(name.c_str(), ooc_cache_bytes); },
+				[](const OocModel& m) { return m.clusters() > 0; });
+		return load(entry(models, name), name, [&] { return new Model(name.c_str(), lod); },
+			[](const Model& m) { return m.nfaces() > 0; });
+	}
+	const envmap_env_t* envmap(const std::string& name)
+	{
+		return load(entry(envmaps, name), name, [&] { return new envmap_env_t(name.c_str()); },
+			[](const envmap_env_t&) { return true; });//the constructor throws on failure
+	}
+	size_t ooc_cache_bytes;
+	bool lod;//build the levels of detail of the models
+private:
+	template <class T>
+	struct entry_t
+	{
+		std::mutex mx;
+		std::unique_ptr<T> value;//set once, never replaced
+	};
+	std::mutex mx;//guards the maps only
+	std::map<std::string, entry_t<Model> > models;
+	std::map<std::string, entry_t<OocModel> > oocs;
+	std::map<std::string, entry_t<envmap_env_t> > envmaps;
+
+	template <class T>
+	entry_t<T>& entry(std::map<std::string, entry_t<T> >& map, const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		return map[name];//map nodes do not move
+	}
+	//a load that throws or gives an unusable asset is not kept, the next request for the file tries again
+	template <class T, class F, class V>
+	static const T* load(entry_t<T>& e, const std::string& name, F create, V valid)
+	{
+		std::lock_guard<std::mutex> lock(e.mx);
+		if (!e.value)
+		{
+			std::unique_ptr<T> value(create());
+			if (!valid(*value))
+				throw std::string("Cannot read file: ") + name;
+			e.value = std::move(value);
+		}
+		return e.value.get();
+	}
+};
+
+static uint32_t crc32(const unsigned char* p, const size_t n, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	static std::once_flag once;
+	std::call_once(once, []
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	});
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+//8 bit RGB PNG, zlib stream of stored blocks: no compression, the bytes only go over the local socket
+static std::vector<unsigned char> encode_png(const Vec3f* colors, const unsigned width, const unsigned height)
+{
+	std::vector<unsigned char> raw;
+	raw.reserve(size_t(height) * (1 + 3 * size_t(width)));
+	for (unsigned j = 0; j < height; j++)
+	{
+		raw.push_back(0);//filter type none
+		for (unsigned i = 0; i < width; i++)
+		{
+			unColor_t c;
+			c.color = toColor(colors[size_t(j) * width + i]);
+			raw.push_back(c.c.r);
+			raw.push_back(c.c.g);
+			raw.push_back(c.c.b);
+		}
+	}
+	std::vector<unsigned char> z;
+	z.push_back(0x78);
+	z.push_back(0x01);
+	uint32_t a = 1, b = 0;
+	for (size_t pos = 0; pos < raw.size(); )
+	{
+		size_t n = std::min<size_t>(65535, raw.size() - pos);
+		z.push_back(pos + n == raw.size() ? 1 : 0);
+		z.push_back(uint8_t(n));
+		z.push_back(uint8_t(n >> 8));
+		z.push_back(uint8_t(~n));
+		z.push_back(uint8_t(~n >> 8));
+		for (size_t i = pos; i < pos + n; i++)
+		{
+			z.push_back(raw[i]);
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		pos += n;
+	}
+	const uint32_t adler = (b << 16) | a;
+	for (int k = 3; k >= 0; k--)
+		z.push_back(uint8_t(adler >> (8 * k)));
+
+	std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	auto chunk = [&png](const char* type, const unsigned char* data, const size_t n)
+	{
+		for (int k = 3; k >= 0; k--)
+			png.push_back(uint8_t(n >> (8 * k)));
+		size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data, data + n);
+		uint32_t crc = crc32(&png[start], png.size() - start);
+		for (int k = 3; k >= 0; k--)
+			png.push_back(uint8_t(crc >> (8 * k)));
+	};
+	const unsigned char ihdr[13] = { uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+		uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height), 8, 2, 0, 0, 0 };
+	chunk("IHDR", ihdr, sizeof(ihdr));
+	chunk("IDAT", z.data(), z.size());
+	chunk("IEND", nullptr, 0);
+	return png;
+}
+
+static bool send_all(const socket_t s, const char* p, size_t n)
+{
+	while (n)
+	{
+		int sent = send(s, p, int(std::min<size_t>(n, 1 << 20)), 0);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		n -= sent;
+	}
+	return true;
+}
+
+//parses a request line into the job, throws std::string on malformed requests
+static void parse_request(const std::string& line, const Scene_t& base, asset_cache_t& cache, server_job_t& job)
+{
+	std::istringstream iss(line);
+	std::string word, model = "untitled.obj";
+	iss >> word;
+	if (word != "render")
+		throw std::string("unknown request: ") + word;
+	job.scene = base;
+	job.width = 320;
+	job.height = 240;
+	while (iss >> word)
+	{
+		size_t eq = word.find('=');
+		if (eq == std::string::npos)
+			throw std::string("expected key=value: ") + word;
+		std::string key = word.substr(0, eq), value = word.substr(eq + 1);
+		if (key == "width")
+			job.width = unsigned(atoi(value.c_str()));
+		else if (key == "height")
+			job.height = unsigned(atoi(value.c_str()));
+		else if (key == "spp")
+		{
+			int spp = atoi(value.c_str());
+			job.fp.spp = spp >= 4 ? 4 : (spp >= 2 ? 2 : 1);//the sample patterns there are
+		}
+		else if (key == "depth")//glass spawns two rays per bounce, deep requests would stall the shared pool
+			job.fp.max_depth = unsigned(std::max(1, std::min(int(server_max_depth), atoi(value.c_str()))));
+		else if (key == "pos")
+		{
+			Vec3f& p = job.fp.camera.position;
+			if (sscanf(value.c_str(), "%f,%f,%f", &p.x, &p.y, &p.z) != 3)
+				throw std::string("expected pos=x,y,z: ") + value;
+		}
+		else if (key == "yaw")
+			job.fp.camera.yaw = float(atof(value.c_str()));
+		else if (key == "pitch")
+			job.fp.camera.pitch = float(atof(value.c_str()));
+		else if (key == "model")
+			model = value;
+		else if (key == "envmap")
+			job.scene.penvmap = cache.envmap(value);
+		else
+			throw std::string("unknown key: ") + key;
+	}
+	if (!job.width || !job.height || job.width > server_max_side || job.height > server_max_side)
+		throw std::string("width and height must be in [1, ") + std::to_string(server_max_side) + "]";
+	job.fp.width = job.width;
+	job.fp.height = job.height;
+	if (model != "none")
+		job.scene.objects.push_back(cache.model(model));
+}
+
+static void serve_connection(const socket_t s, const Scene_t& base, asset_cache_t& cache, server_pool_t& pool)
+{
+	std::string pending;
+	char buf[4096];
+	for (;;)
+	{
+		size_t eol;
+		while ((eol = pending.find('\n')) == std::string::npos)
+		{
+			int n = recv(s, buf, sizeof(buf), 0);
+			if (n <= 0 || pending.size() > 65536)
+			{
+				close_socket(s);
+				return;
+			}
+			pending.append(buf, n);
+		}
+		std::string line = pending.substr(0, eol);
+		pending.erase(0, eol + 1);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+
+		std::string reply;
+		std::vector<unsigned char> png;
+		try
+		{
+			auto tp = std::chrono::high_resolution_clock::now();
+			server_job_t job;
+			parse_request(line, base, cache, job);
+			auto tr = std::chrono::high_resolution_clock::now();
+			pool.render(job);
+			png = encode_png(job.colors.data(), job.width, job.height);
+			auto te = std::chrono::high_resolution_clock::now();
+			std::cerr << job.width << "x" << job.height << " setup: " << std::chrono::duration<double>(tr - tp).count() * 1e3
+				<< " ms, render: " << std::chrono::duration<double>(te - tr).count() * 1e3 << " ms" << std::endl;
+			reply = "OK " + std::to_string(png.size()) + "\n";
+		}
+		catch (const std::string& e)
+		{
+			reply = "ERR " + e + "\n";
+		}
+		catch (const std::exception& e)//out of memory on a huge or corrupt asset, the server carries on
+		{
+			reply = std::string("ERR ") + e.what() + "\n";
+		}
+		catch (...)
+		{
+			reply = "ERR internal error\n";
+		}
+		if (!send_all(s, reply.data(), reply.size()) || (!png.empty() && !send_all(s, (const char*)png.data(), png.size())))
+		{
+			close_socket(s);
+			return;
+		}
+	}
+}
+
+int run_server(const unsigned short port, const Scene_t& base, const unsigned workers_num, const bool lod, const size_t ooc_cache_bytes)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa))
+	{
+		std::cerr << "WSAStartup failed" << std::endl;
+		return -1;
+	}
+#else
+	signal(SIGPIPE, SIG_IGN);//a client that hangs up fails its send instead of killing the server
+#endif
+	socket_t ls = socket(AF_INET, SOCK_STREAM, 0);
+	if (ls == INVALID_SOCKET)
+	{
+		std::cerr << "Couldn't create socket" << std::endl;
+		return -1;
+	}
+	int on = 1;
+	setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);//local requests only
+	if (bind(ls, (const sockaddr*)&addr, sizeof(addr)) || listen(ls, 16))
+	{
+		std::cerr << "Couldn't listen on port " << port << std::endl;
+		close_socket(ls);
+		return -1;
+	}
+	std::cerr << "render server on 127.0.0.1:" << port << ", " << workers_num << " workers" << std::endl;
+
+	static asset_cache_t cache;
+	cache.ooc_cache_bytes = ooc_cache_bytes;
+	cache.lod = lod;
+	static server_pool_t pool(workers_num, lod);
+	for (;;)
+	{
+		socket_t s = accept(ls, nullptr, nullptr);
+		if (s == INVALID_SOCKET)
+			continue;
+		std::thread(serve_connection, s, std::cref(base), std::ref(cache), std::ref(pool)).detach();
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "util.hpp"
+#include "fastmath.hpp"
+
+/*
+	Per hit shading terms shared by the recursive tracer (render.cpp) and the ray batches (raysort.cpp).
+	features is a set of material_feature_t, a compile time constant in the shading kernels so the
+	terms the material does not have fold away there.
+*/
+
+//origin of a ray leaving point in dir, offset off the surface to avoid occlusion by the object itself
+inline Vec3f offset_origin(const Vec3f& point, const Vec3f& dir, const Vec3f& N)
+{
+	return dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+}
+
+//unshadowed diffuse and specular light of one light scaled by weight, light_dir and light_distance lead to the light
+template <bool FAST>
+inline Vec3f light_color(const unsigned features, const Light_t& light, const float weight, const Vec3f& dir, const Vec3f& point, const Vec3f& N,
+	const Material& material, Vec3f& light_dir, float& light_distance)
+{
+	light_dir = math_direction<FAST>(light.position - point, light_distance);
+	Vec3f color;
+	if (features & MATERIAL_DIFFUSE)
+		color = material.diffuse * (weight * light.intensity * std::max(0.f, light_dir * N) * material.albedo[0]);
+	if (features & MATERIAL_SPECULAR)
+		color = color + Vec3f(1., 1., 1.) * (weight * math_pow<FAST>(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * light.intensity * material.albedo[1]);
+	return color;
+}
+
+//calls visit(light, weight) for the lights shading point: with a light tree a few sampled lights
+//weighted by one over the probability they were picked with, all lights otherwise
+template <class V>
+inline void for_each_light(const Scene_t& scene, const Vec3f& point, V visit)
+{
+	const std::vector<const Light_t*>& lights = scene.lights;
+	if (scene.light_tree)
+	{
+		const light_tree_t& tree = *scene.light_tree;
+		for (unsigned s = 0; s < tree.samples; s++)
+		{
+			float pdf;
+			int i = tree.sample(point, light_rand(), pdf);
+			if (i >= 0 && pdf > 0)
+				visit(*lights[i], 1.f / (tree.samples * pdf));
+		}
+	}
+	else for (size_t i = 0; i < lights.size(); i++)
+		visit(*lights[i], 1.f);
+}
@@ -0,0 +1,232 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <iostream>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SPHERECLOUD_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AVX2_TARGET//MSVC takes the intrinsics without /arch:AVX2
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#include "util.hpp"
+#include "bvh.hpp"
+
+/*
+	Sphere cloud: centers and radii in separate arrays (SoA), a material index per sphere,
+	a BVH over the cloud with leaves of up to 8 spheres tested in one go.
+	On x86 the AVX2 kernel is always built and picked at runtime when the CPU has AVX2, the scalar loop is used otherwise.
+*/
+
+SphereCloud::SphereCloud()
+	: cx(), cy(), cz(), r(), mat(), materials(), nodes()
+{}
+
+unsigned SphereCloud::add_material(const Material& material)
+{
+	materials.push_back(material);
+	return unsigned(materials.size() - 1);
+}
+
+void SphereCloud::add(const Vec3f& center, const float radius, const unsigned material)
+{
+	cx.push_back(center.x);
+	cy.push_back(center.y);
+	cz.push_back(center.z);
+	r.push_back(radius);
+	mat.push_back(uint16_t(material));
+}
+
+size_t SphereCloud::size() const
+{
+	return mat.size();
+}
+
+void SphereCloud::build()
+{
+	nodes.clear();
+	if (mat.empty())
+		return;
+	std::vector<unsigned> idx(mat.size());
+	std::iota(idx.begin(), idx.end(), 0u);
+	nodes.reserve(2 * mat.size() / leaf_size + 1);
+	bvh_build(nodes, idx, 0, unsigned(idx.size()), leaf_size,
+		[this](const unsigned i, Vec3f& lo, Vec3f& hi)
+	{
+		lo = Vec3f(cx[i] - r[i], cy[i] - r[i], cz[i] - r[i]);
+		hi = Vec3f(cx[i] + r[i], cy[i] + r[i], cz[i] + r[i]);
+	},
+		[](node_t& leaf, const unsigned first, const unsigned count)
+	{
+		leaf.offset = first;
+		leaf.count = uint16_t(count);
+	},
+		[](node_t& inner, const int axis)
+	{
+		inner.count = 0;
+		inner.axis = uint16_t(axis);
+	});
+
+	//reorder the arrays into leaf order, leaves address contiguous ranges
+	auto permute = [&](auto& v)
+	{
+		typename std::remove_reference<decltype(v)>::type t(v.size());
+		for (size_t k = 0; k < idx.size(); k++)
+			t[k] = v[idx[k]];
+		v.swap(t);
+	};
+	permute(cx);
+	permute(cy);
+	permute(cz);
+	permute(r);
+	permute(mat);
+	//padding, so 8 wide loads of the last leaf stay inside the arrays; the lanes are masked out
+	for (unsigned k = 0; k < leaf_size; k++)
+	{
+		cx.push_back(0);
+		cy.push_back(0);
+		cz.push_back(0);
+		r.push_back(0);
+	}
+	nodes.shrink_to_fit();
+	std::cerr << "sphere cloud: " << size() << " spheres, " << nodes.size() << " nodes, "
+		<< (size() * (4 * sizeof(float) + sizeof(uint16_t)) + nodes.size() * sizeof(node_t)) / (1024 * 1024) << " MB" << std::endl;
+}
+
+#ifdef SPHERECLOUD_AVX2
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;//no AVX, or the OS does not save the ymm registers
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const bool use_avx2 = cpu_has_avx2();
+
+//8 spheres at once, the lanes past count are masked off
+AVX2_TARGET static int leaf_intersect_avx2(const float* cx, const float* cy, const float* cz, const float* r, const unsigned first, const unsigned count,
+	const Vec3f& orig, const Vec3f& dir, float& dist)
+{
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 lx = _mm256_sub_ps(_mm256_loadu_ps(&cx[first]), ox);
+	__m256 ly = _mm256_sub_ps(_mm256_loadu_ps(&cy[first]), oy);
+	__m256 lz = _mm256_sub_ps(_mm256_loadu_ps(&cz[first]), oz);
+	__m256 rad = _mm256_loadu_ps(&r[first]);
+	__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, dx), _mm256_mul_ps(ly, dy)), _mm256_mul_ps(lz, dz));
+	__m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+	__m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+	__m256 r2 = _mm256_mul_ps(rad, rad);
+	__m256 thc = _mm256_sqrt_ps(_mm256_max_ps(zero, _mm256_sub_ps(r2, d2)));
+	__m256 t0 = _mm256_sub_ps(tca, thc), t1 = _mm256_add_ps(tca, thc);
+	__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 mask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(int(count)), lane));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(dist), _CMP_LT_OQ));
+	int bits = _mm256_movemask_ps(mask);
+	if (!bits)
+		return -1;
+	alignas(32) float ts[8];
+	_mm256_store_ps(ts, t);
+	int best = -1;
+	for (; bits; bits &= bits - 1)
+	{
+		int k = 0;
+		while (!((bits >> k) & 1))
+			k++;
+		if (ts[k] < dist)
+		{
+			dist = ts[k];
+			best = int(first) + k;
+		}
+	}
+	return best;
+}
+#endif
+
+//nearest hit among the leaf spheres closer than dist, same rules as Sphere::ray_intersect, -1 when none
+int SphereCloud::leaf_intersect(const node_t& leaf, const Vec3f& orig, const Vec3f& dir, float& dist) const
+{
+	const unsigned first = leaf.offset;
+#ifdef SPHERECLOUD_AVX2
+	if (use_avx2)
+		return leaf_intersect_avx2(cx.data(), cy.data(), cz.data(), r.data(), first, leaf.count, orig, dir, dist);
+#endif
+	int best = -1;
+	for (unsigned k = first; k < first + leaf.count; k++)
+	{
+		float lx = cx[k] - orig.x, ly = cy[k] - orig.y, lz = cz[k] - orig.z;
+		float tca = lx * dir.x + ly * dir.y + lz * dir.z;
+		float d2 = lx * lx + ly * ly + lz * lz - tca * tca;
+		if (d2 > r[k] * r[k])
+			continue;
+		float thc = sqrtf(r[k] * r[k] - d2);
+		float t = tca - thc;
+		if (t < 0)
+			t = tca + thc;
+		if (t >= 0 && t < dist)
+		{
+			dist = t;
+			best = int(k);
+		}
+	}
+	return best;
+}
+
+bool SphereCloud::ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material) const
+{
+	if (nodes.empty())
+		return false;
+	float inv[3];
+	for (int j = 0; j < 3; j++)
+		inv[j] = 1.f / dir[j];
+
+	int hit = -1;
+	unsigned stack[64];
+	unsigned sp = 0;
+	stack[sp++] = 0;
+	while (sp)
+	{
+		const node_t& node = nodes[stack[--sp]];
+		if (!bvh_box_hit(node, orig, inv, dist))
+			continue;
+		if (node.count)
+		{
+			int k = leaf_intersect(node, orig, dir, dist);
+			if (k >= 0)
+				hit = k;
+			continue;
+		}
+		//visit the near child first
+		unsigned left = unsigned(&node - &nodes[0]) + 1, right = node.offset;
+		if (dir[node.axis] < 0)
+			std::swap(left, right);
+		stack[sp++] = right;
+		stack[sp++] = left;
+	}
+	if (hit < 0)
+		return false;
+	Vec3f center(cx[hit], cy[hit], cz[hit]);
+	N = (orig + dir * dist - center).normalize();
+	material = materials[mat[hit]];
+	return true;
+}
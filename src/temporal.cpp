@@ -0,0 +1,121 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "temporal.hpp"
+
+temporal_t::temporal_t(const unsigned refresh)
+	: refresh(std::max(1u, refresh)), reused(), traced(), cur(), prev(), cur_fp(), cur_fast(false)
+{}
+
+std::shared_ptr<const std::vector<uint8_t> > temporal_t::start_frame(const frame_params_t& fp, const unsigned width, const unsigned height,
+	const bool fast, std::vector<unsigned long long>& pixels)
+{
+	const size_t n = size_t(fp.width) * fp.height;
+	std::shared_ptr<std::vector<uint8_t> > retrace = std::make_shared<std::vector<uint8_t> >(n, uint8_t(1));
+	prev.swap(cur);
+	cur.assign(n, texel_t());
+	const bool compatible = prev.size() == n && cur_fp.width == fp.width && cur_fp.scale == fp.scale &&
+		cur_fp.spp == fp.spp && cur_fp.max_depth == fp.max_depth && cur_fast == fast;
+	cur_fp = fp;
+	cur_fp.retrace.reset();
+	cur_fast = fast;
+	if (!compatible)
+	{
+		//a full frame is traced, staggered ages spread its refresh over the next refresh frames
+		for (size_t q = 0; q < n; q++)
+			cur[q].age = unsigned(q * 7919 % refresh);
+		traced += n;
+		return retrace;
+	}
+
+	//forward splat, the nearest point wins a pixel; view dependent surfaces are splatted too, they still hide what is behind them
+	const camera_basis_t basis(fp.camera, width, height);
+	std::vector<float> dist(n, std::numeric_limits<float>::max());
+	std::vector<uint8_t> reusable(n);
+	for (size_t p = 0; p < n; p++)
+	{
+		const texel_t& t = prev[p];
+		if (t.flags != COMPLETE)
+			continue;
+		Vec3f v = t.surface.point;
+		float d = std::numeric_limits<float>::max();
+		bool reuse = true;
+		if (t.surface.hit)
+		{
+			v = v - basis.position;
+			d = v.norm();
+			reuse = !(t.surface.features & (MATERIAL_SPECULAR | MATERIAL_REFLECTIVE | MATERIAL_REFRACTIVE)) &&
+				-(t.surface.N * v) > 0.05f * d;//back facing or nearly edge on, the color is not reliable
+		}
+		float x, y;
+		if (!basis.project(v, x, y) || x < 0 || y < 0)
+			continue;
+		unsigned i = unsigned(x) / fp.scale, j = unsigned(y) / fp.scale;
+		if (i >= fp.width || j >= fp.height)
+			continue;
+		size_t q = size_t(j) * fp.width + i;
+		if (d < dist[q] || (!t.surface.hit && cur[q].flags != COMPLETE))
+		{
+			dist[q] = d;
+			cur[q] = t;
+			cur[q].age++;
+			reusable[q] = reuse;
+		}
+	}
+
+	//reject pixels a neighbour lands in front of, the splat left a gap in a nearer surface there
+	for (unsigned j = 0; j < fp.height; j++)
+	{
+		for (unsigned i = 0; i < fp.width; i++)
+		{
+			size_t q = size_t(j) * fp.width + i;
+			const texel_t& t = cur[q];
+			if (t.flags != COMPLETE || !reusable[q] || t.age >= refresh)
+				continue;
+			bool occluded = false;
+			for (unsigned nj = j ? j - 1 : 0; nj <= std::min(j + 1, fp.height - 1) && !occluded; nj++)
+			{
+				for (unsigned ni = i ? i - 1 : 0; ni <= std::min(i + 1, fp.width - 1) && !occluded; ni++)
+				{
+					size_t nq = size_t(nj) * fp.width + ni;
+					if (cur[nq].flags != COMPLETE || !cur[nq].surface.hit || dist[nq] >= dist[q])
+						continue;
+					occluded = !t.surface.hit || (cur[nq].surface.point - t.surface.point) * t.surface.N > 0.02f * dist[q];
+				}
+			}
+			if (!occluded)
+				(*retrace)[q] = 0;
+		}
+	}
+	size_t kept = 0;
+	for (size_t q = 0; q < n; q++)
+	{
+		if ((*retrace)[q])
+		{
+			cur[q] = texel_t();
+			continue;
+		}
+		pixels.push_back(((unsigned long long)q << 32) + cur[q].color);
+		kept++;
+	}
+	reused += kept;
+	traced += n - kept;
+	return retrace;
+}
+
+void temporal_t::store_color(const unsigned pixel, const unsigned color)
+{
+	if (pixel >= cur.size())
+		return;
+	cur[pixel].color = color;
+	cur[pixel].flags |= HAS_COLOR;
+}
+
+void temporal_t::store_surface(const unsigned pixel, const surface_t& surface)
+{
+	if (pixel >= cur.size())
+		return;
+	cur[pixel].surface = surface;
+	cur[pixel].flags |= HAS_SURFACE;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "geometry.hpp"
+#include "util.hpp"
+
+/*
+	Temporal reuse: the pixels of the previous frame with their primary hit are moved to where
+	the hit point lands in the new view, only pixels nothing valid lands on are traced again.
+	A reprojected pixel is dropped when its surface is view dependent (specular, reflective, refractive),
+	when it is seen edge on or from behind, or when a neighbour lands in front of its tangent plane,
+	the background seen through a gap of a foreground surface. On top of that every texel carries the
+	frames since it was traced, moved along with it, and is traced again once that reaches refresh.
+*/
+class temporal_t
+{
+public:
+	temporal_t(const unsigned refresh = 16);
+
+	//reprojects the previous frame into fp, appends the reused pixels packed as the workers do and returns the pixels to trace
+	std::shared_ptr<const std::vector<uint8_t> > start_frame(const frame_params_t& fp, const unsigned width, const unsigned height,
+		const bool fast, std::vector<unsigned long long>& pixels);
+	void store_color(const unsigned pixel, const unsigned color);
+	void store_surface(const unsigned pixel, const surface_t& surface);
+
+	unsigned refresh;
+	unsigned long long reused, traced;//pixels, accumulated over frames
+private:
+	enum { HAS_COLOR = 1, HAS_SURFACE = 2, COMPLETE = 3 };
+	struct texel_t
+	{
+		texel_t()
+			: color(), surface(), flags(), age()
+		{}
+		unsigned color;
+		surface_t surface;
+		unsigned flags;
+		unsigned age;//frames since the pixel was traced
+	};
+	std::vector<texel_t> cur, prev;
+	frame_params_t cur_fp;
+	bool cur_fast;
+};
@@ -0,0 +1,198 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <iostream>
+
+#include "util.hpp"
+
+/*
+	Streaming output for images larger than memory: tiles are rendered by the workers and appended
+	to a tiled TIFF as soon as they are done, in whatever order they finish. Only the tile offsets
+	are kept until the end, where the directory is written and the header is patched to point to it.
+	BigTIFF (64 bit offsets) is used once the file can pass 4 GB, 8 bit RGB, no compression.
+*/
+
+enum tiff_type_t { TIFF_SHORT = 3, TIFF_LONG = 4, TIFF_LONG8 = 16 };
+
+struct tiff_entry_t
+{
+	uint16_t tag;
+	tiff_type_t type;
+	std::vector<uint64_t> values;
+};
+
+static void put_le(std::vector<char>& out, const uint64_t v, const unsigned bytes)
+{
+	for (unsigned k = 0; k < bytes; k++)
+		out.push_back(char((v >> (8 * k)) & 0xff));
+}
+
+static unsigned tiff_type_size(const tiff_type_t type)
+{
+	return type == TIFF_SHORT ? 2 : (type == TIFF_LONG ? 4 : 8);
+}
+
+//writes the directory at the end of the file, values that do not fit into an entry go in front of it
+static bool write_tiff_ifd(std::ofstream& out, std::vector<tiff_entry_t>& entries, const bool big)
+{
+	const unsigned inline_bytes = big ? 8 : 4;
+	uint64_t pos = uint64_t(out.tellp());
+	std::vector<char> data, ifd;
+	std::vector<uint64_t> value_offsets(entries.size());
+	for (size_t e = 0; e < entries.size(); e++)
+	{
+		size_t bytes = entries[e].values.size() * tiff_type_size(entries[e].type);
+		if (bytes <= inline_bytes)
+			continue;
+		if (data.size() & 1)
+			data.push_back(0);//word alignment
+		value_offsets[e] = pos + data.size();
+		for (size_t k = 0; k < entries[e].values.size(); k++)
+			put_le(data, entries[e].values[k], tiff_type_size(entries[e].type));
+	}
+	if (data.size() & 1)
+		data.push_back(0);
+	const uint64_t ifd_offset = pos + data.size();
+
+	put_le(ifd, entries.size(), big ? 8 : 2);
+	for (size_t e = 0; e < entries.size(); e++)
+	{
+		const tiff_entry_t& en = entries[e];
+		put_le(ifd, en.tag, 2);
+		put_le(ifd, en.type, 2);
+		put_le(ifd, en.values.size(), big ? 8 : 4);
+		size_t bytes = en.values.size() * tiff_type_size(en.type);
+		if (bytes <= inline_bytes)
+		{
+			for (size_t k = 0; k < en.values.size(); k++)
+				put_le(ifd, en.values[k], tiff_type_size(en.type));
+			for (size_t k = bytes; k < inline_bytes; k++)
+				ifd.push_back(0);
+		}
+		else
+			put_le(ifd, value_offsets[e], inline_bytes);
+	}
+	put_le(ifd, 0, inline_bytes);//no next directory
+
+	out.write(data.data(), std::streamsize(data.size()));
+	out.write(ifd.data(), std::streamsize(ifd.size()));
+	std::vector<char> header;
+	put_le(header, ifd_offset, inline_bytes);
+	out.seekp(big ? 8 : 4);
+	out.write(header.data(), std::streamsize(header.size()));
+	return bool(out);
+}
+
+int render_tiled(const Scene_t& scene, const frame_params_t& fp, const unsigned width, const unsigned height, const unsigned tile,
+	const int workers_num, const bool lod, const char* file_name)
+{
+	if (!width || !height || !tile || tile % 16)
+	{
+		std::cerr << "image size must be positive and the tile size a multiple of 16" << std::endl;
+		return 1;
+	}
+	const unsigned tiles_x = (width + tile - 1) / tile, tiles_y = (height + tile - 1) / tile;
+	const uint64_t tile_bytes = uint64_t(tile) * tile * 3;
+	const uint64_t tiles = uint64_t(tiles_x) * tiles_y;
+	const bool big = tiles * tile_bytes + tiles * 16 + 4096 > 0xffffffffull;
+
+	std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		std::cerr << "Failed to create " << file_name << std::endl;
+		return 1;
+	}
+	std::vector<char> header;
+	header.push_back('I');
+	header.push_back('I');
+	if (big)
+	{
+		put_le(header, 43, 2);
+		put_le(header, 8, 2);//bytes per offset
+		put_le(header, 0, 2);
+		put_le(header, 0, 8);//first directory, patched at the end
+	}
+	else
+	{
+		put_le(header, 42, 2);
+		put_le(header, 0, 4);
+	}
+	out.write(header.data(), std::streamsize(header.size()));
+
+	std::vector<uint64_t> offsets(tiles);
+	std::atomic<uint64_t> next_tile(0);
+	std::mutex file_mx;
+	uint64_t tiles_done = 0;
+	bool failed = false;
+	auto tp = std::chrono::high_resolution_clock::now();
+	auto worker = [&]()
+	{
+		std::vector<Vec3f> colors(size_t(tile) * tile);
+		std::vector<char> pixels(tile_bytes);
+		for (uint64_t t; (t = next_tile++) < tiles; )
+		{
+			const unsigned x0 = unsigned(t % tiles_x) * tile, y0 = unsigned(t / tiles_x) * tile;
+			const unsigned x1 = std::min(width, x0 + tile), y1 = std::min(height, y0 + tile);
+			render_tile(scene, fp, width, height, x0, y0, x1, y1, lod, colors.data());
+			std::fill(pixels.begin(), pixels.end(), 0);//edge tiles are padded to the full tile size
+			for (unsigned j = 0; j < y1 - y0; j++)
+			{
+				for (unsigned i = 0; i < x1 - x0; i++)
+				{
+					unColor_t c;
+					c.color = toColor(colors[j * (x1 - x0) + i]);
+					char* p = &pixels[(size_t(j) * tile + i) * 3];
+					p[0] = char(c.c.r);
+					p[1] = char(c.c.g);
+					p[2] = char(c.c.b);
+				}
+			}
+			std::lock_guard<std::mutex> lock(file_mx);
+			offsets[t] = uint64_t(out.tellp());
+			out.write(pixels.data(), std::streamsize(pixels.size()));
+			failed |= !out;
+			if (failed)
+				return;
+			tiles_done++;
+			if (tiles_done * 100 / tiles != (tiles_done - 1) * 100 / tiles)
+				std::cerr << "\r" << tiles_done * 100 / tiles << "% of " << tiles << " tiles" << std::flush;
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 0; i < workers_num; i++)
+		threads.push_back(std::thread(worker));
+	for (auto& t : threads)
+		t.join();
+	std::cerr << std::endl;
+	if (failed)
+	{
+		std::cerr << "Failed to write " << file_name << std::endl;
+		return 1;
+	}
+
+	const tiff_type_t offset_type = big ? TIFF_LONG8 : TIFF_LONG;
+	std::vector<tiff_entry_t> entries = {//ascending tag order
+		{ 256, TIFF_LONG, { width } },			//ImageWidth
+		{ 257, TIFF_LONG, { height } },			//ImageLength
+		{ 258, TIFF_SHORT, { 8, 8, 8 } },		//BitsPerSample
+		{ 259, TIFF_SHORT, { 1 } },				//Compression, none
+		{ 262, TIFF_SHORT, { 2 } },				//PhotometricInterpretation, RGB
+		{ 277, TIFF_SHORT, { 3 } },				//SamplesPerPixel
+		{ 284, TIFF_SHORT, { 1 } },				//PlanarConfiguration, interleaved
+		{ 322, TIFF_LONG, { tile } },			//TileWidth
+		{ 323, TIFF_LONG, { tile } },			//TileLength
+		{ 324, offset_type, offsets },			//TileOffsets
+		{ 325, offset_type, std::vector<uint64_t>(tiles, tile_bytes) }//TileByteCounts
+	};
+	if (!write_tiff_ifd(out, entries, big))
+	{
+		std::cerr << "Failed to write " << file_name << std::endl;
+		return 1;
+	}
+	std::cerr << file_name << ": " << width << "x" << height << " in " << tiles << " tiles of " << tile << "x" << tile
+		<< (big ? ", BigTIFF, " : ", ") << std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tp).count() << " s" << std::endl;
+	return 0;
+}
@@ -3,6 +3,9 @@
 #include <vector>
 #include <algorithm>
 #include <mutex>
+#include <cstdint>
+#include <memory>
+#include <condition_variable>
 
 #include "geometry.hpp"
 #include "stb_image.h"
@@ -32,6 +35,23 @@ inline unsigned toColor(const Vec3f& color)
 }
 
 bool RayIntersectsTriangle(const Vec3f& orig, const Vec3f& dir, float& dist, const Vec3f& vertex0, const Vec3f& vertex1, const Vec3f& vertex2);//in model.cpp
+//in lod.cpp, quadric error edge collapse down to target_faces, returns the error of the result:
+//the larger of the distance to the full mesh and the offset the tilt of the faces amounts to across them
+float simplify_mesh(const std::vector<Vec3f>& verts, const std::vector<Vec3i>& faces, const size_t target_faces,
+	std::vector<Vec3f>& out_verts, std::vector<Vec3i>& out_faces);
+
+struct ray_cone_t//footprint of a ray, used for level of detail selection
+{
+	ray_cone_t()
+		: width(), spread()
+	{}
+	ray_cone_t(const float width, const float spread)
+		: width(width), spread(spread) {}
+	float width;	//at the ray origin
+	float spread;	//growth of the width per unit of distance, zero selects full detail
+
+	ray_cone_t at(const float dist) const { return ray_cone_t(width + spread * dist, spread); }
+};
 
 class SceneObject_t
 {
@@ -53,16 +73,54 @@ public:
 	float intensity;
 };
 
+//in lighttree.cpp
+class light_tree_t//BVH over the point lights, picks lights at random in proportion to their estimated contribution
+{
+public:
+	light_tree_t(const std::vector<const Light_t*>& lights, const unsigned samples);
+	//index of the light for point, u uniform in [0, 1), pdf is the probability it was picked with, -1 without lights
+	int sample(const Vec3f& point, float u, float& pdf) const;
+	unsigned samples;//shadow rays per hit
+private:
+	struct node_t
+	{
+		Vec3f bb_min, bb_max;
+		float intensity;	//sum of the lights below
+		unsigned offset;	//inner: right child, leaf: light index, the left child follows its parent
+		bool leaf;
+	};
+	std::vector<node_t> nodes;
+
+	float importance(const node_t& node, const Vec3f& point) const;
+};
+float light_rand();//uniform [0, 1), a generator per thread
+
+
+enum material_feature_t//terms of the shading equation with a nonzero albedo weight
+{
+	MATERIAL_DIFFUSE = 1,
+	MATERIAL_SPECULAR = 2,
+	MATERIAL_REFLECTIVE = 4,
+	MATERIAL_REFRACTIVE = 8,
+	MATERIAL_FEATURES_ALL = 15
+};
 
 struct Material
 {
 	Material(const Vec4f& albedo, const Vec3f& diffuse, const float specular, const float refractive)
-		: albedo(albedo), diffuse(diffuse), specular_exponent(specular), refractive(refractive) {}
-	Material() : albedo(1, 0, 0, 0), diffuse(), specular_exponent(), refractive() {}
+		: albedo(albedo), diffuse(diffuse), specular_exponent(specular), refractive(refractive), features() { classify(); }
+	Material() : albedo(1, 0, 0, 0), diffuse(), specular_exponent(), refractive(), features(MATERIAL_DIFFUSE) {}
 	Vec4f albedo;
 	Vec3f diffuse;//diffuse color
 	float specular_exponent;
 	float refractive;// refractive index
+	unsigned features;//material_feature_t set, selects the shading kernel
+
+	void classify()//call after changing albedo
+	{
+		features = (albedo[0] != 0 ? MATERIAL_DIFFUSE : 0) | (albedo[1] != 0 ? MATERIAL_SPECULAR : 0) |
+			(albedo[2] != 0 ? MATERIAL_REFLECTIVE : 0) | (albedo[3] != 0 ? MATERIAL_REFRACTIVE : 0);
+	}
 };
 
 class Sphere : public SceneObject_t
@@ -75,22 +133,58 @@ public:
 	Material material;
 };
 
+class SphereCloud : public SceneObject_t//millions of spheres sharing a few materials, in spherecloud.cpp
+{
+private:
+	static const unsigned leaf_size = 8;
+	struct node_t
+	{
+		float bb_min[3], bb_max[3];
+		unsigned offset;	//leaf: first sphere, inner node: right child, the left one follows the node
+		uint16_t count;		//spheres in a leaf, zero for inner nodes
+		uint16_t axis;		//split axis of an inner node
+	};
+	std::vector<float> cx, cy, cz, r;
+	std::vector<uint16_t> mat;
+	std::vector<Material> materials;
+	std::vector<node_t> nodes;
+
+	int leaf_intersect(const node_t& leaf, const Vec3f& orig, const Vec3f& dir, float& dist) const;
+public:
+	SphereCloud();
+
+	unsigned add_material(const Material& material);
+	void add(const Vec3f& center, const float radius, const unsigned material);
+	void build();//call after the last add
+	size_t size() const;
+
+	bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material) const;
+};
 
 class Model : public SceneObject_t
 {
 private:
+	struct lod_t
+	{
+		std::vector<Vec3f> verts;
+		std::vector<Vec3i> faces;
+		float error;//max distance to the full mesh
+	};
 	std::vector<Vec3f> verts;
 	std::vector<Vec3i> faces;
+	std::vector<lod_t> lods;//simplified meshes, each about a quarter of the previous one
 	Vec3f bb_min, bb_max;
 
 	void calc_bbox();
+	void build_lods();
 public:
-	Model(const char* filename);
+	Model(const char* filename, const bool with_lods = true);//without the levels of detail when only the full mesh is needed
 
 	int nverts() const;                          // number of vertices
 	int nfaces() const;                          // number of triangles
+	int select_lod(const Vec3f& orig, const ray_cone_t& cone) const;
 
-	bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material) const;
+	bool ray_intersect(const Vec3f& orig, const Vec3f& dir, float& dist, Vec3f& N, Material& material, const ray_cone_t& cone = ray_cone_t()) const;
 	bool ray_triangle_intersect(const int fi, const Vec3f& orig, const Vec3f& dir, float &tnear) const;
 	bool ray_bbox_intersect(const Vec3f& orig, const Vec3f& dir) const;
 
@@ -132,33 +226,151 @@ class Scene_t
 {
 public:
 	Scene_t()
-		: penvmap(0)
+		: penvmap(0), light_tree(0)
 	{}
 	Scene_t(const envmap_env_t* penvmap)
-		: penvmap(penvmap)
+		: penvmap(penvmap), light_tree(0)
 	{}
 
 	const envmap_env_t* penvmap;
+	const light_tree_t* light_tree;//samples of the lights instead of all of them, when set
 
 	std::vector<const Light_t*> lights;
 	std::vector<const SceneObject_t*> objects;
 };
 
+//in render.cpp
+Vec3f reflect(const Vec3f& I, const Vec3f& N);
+Vec3f refract(const Vec3f& I, const Vec3f& N, const float eta_t, const float eta_i = 1.f);
+Vec3f envmap_color(const Scene_t& scene, const Vec3f& dir);
+Vec3f envmap_color_fast(const Scene_t& scene, const Vec3f& dir);
+bool scene_intersect(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, Vec3f& hit, Vec3f& N, Material& material, const ray_cone_t& cone = ray_cone_t());
+Vec3f cast_ray(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t depth = 0, size_t max_depth = 4, const ray_cone_t& cone = ray_cone_t());
+
+struct surface_t//primary hit of a pixel
+{
+	surface_t()
+		: point(), N(), features(), hit(false)
+	{}
+	Vec3f point;		//the ray direction for a miss
+	Vec3f N;
+	unsigned features;	//material_feature_t of the hit
+	bool hit;
+};
+//in render.cpp, cast_ray from the camera that also returns what it hit first
+Vec3f cast_primary_ray(const Vec3f& orig, const Vec3f& dir, const Scene_t& scene, size_t max_depth, const ray_cone_t& cone, surface_t& surface);
+
 
 
 
 
 
 
+struct ray_sort_stats_t	//coherence of the traced ray stream, see raysort.hpp
+{
+	ray_sort_stats_t()
+		: rays(), coherent_unsorted(), coherent_sorted(), batches(), trace_time()
+	{}
+	unsigned long long rays;				//rays passed to scene_intersect
+	unsigned long long coherent_unsorted;	//neighbour rays sharing origin cell and octant in generation order
+	unsigned long long coherent_sorted;		//the same after sorting
+	unsigned long long batches;
+	double trace_time;						//seconds spent in intersection
+
+	void add(const ray_sort_stats_t& s)
+	{
+		rays += s.rays;
+		coherent_unsorted += s.coherent_unsorted;
+		coherent_sorted += s.coherent_sorted;
+		batches += s.batches;
+		trace_time += s.trace_time;
+	}
+};
+
+struct camera_t
+{
+	camera_t()
+		: position(), yaw(), pitch()
+	{}
+	Vec3f position;
+	float yaw, pitch;//radians, zero looks down -z
+
+	Vec3f rotate(const Vec3f& v) const//pitch around x, then yaw around y
+	{
+		float cy = cosf(yaw), sy = sinf(yaw), cp = cosf(pitch), sp = sinf(pitch);
+		Vec3f p(v.x, v.y * cp - v.z * sp, v.y * sp + v.z * cp);
+		return Vec3f(p.x * cy + p.z * sy, p.y, p.z * cy - p.x * sy);
+	}
+	bool operator==(const camera_t& c) const
+	{
+		return position.x == c.position.x && position.y == c.position.y && position.z == c.position.z && yaw == c.yaw && pitch == c.pitch;
+	}
+	bool operator!=(const camera_t& c) const { return !(*this == c); }
+};
+
+struct camera_basis_t//camera_t resolved for a view, primary rays without per pixel trigonometry
+{
+	camera_basis_t(const camera_t& camera, const unsigned width, const unsigned height);//in render.cpp
+	Vec3f position;
+	Vec3f corner, dx, dy;
+
+	Vec3f ray(const float x, const float y) const { return corner + dx * x + dy * y; }//unnormalized, x, y in pixels
+	bool project(const Vec3f& v, float& x, float& y) const//inverse of ray, false behind the camera
+	{
+		Vec3f forward = cross(dx, dy).normalize();
+		float z = v * forward;
+		if (z <= 0)
+			return false;
+		Vec3f r = v * (1.f / z) - corner;
+		x = (r * dx) / (dx * dx);
+		y = (r * dy) / (dy * dy);
+		return true;
+	}
+};
+
+struct frame_params_t//what the workers render, replaced by main to start a new frame
+{
+	frame_params_t()
+		: frame_id(), width(), height(), scale(1), spp(1), max_depth(4), accum(), camera()
+	{}
+	unsigned frame_id;
+	unsigned width, height;	//internal render resolution
+	unsigned scale;			//window pixels per internal pixel along each axis
+	unsigned spp;			//samples per pixel
+	unsigned max_depth;		//recursion limit of cast_ray
+	unsigned accum;			//frames of the same view summed before this one, zero starts over
+	camera_t camera;
+	std::shared_ptr<const std::vector<uint8_t> > retrace;//internal pixels to trace, all of them when null
+};
+
+//in render.cpp, window pixels [x0, x1) x [y0, y1) of a width x height view at full resolution into colors, row by row
+void render_tile(const Scene_t& scene, const frame_params_t& fp, const unsigned width, const unsigned height,
+	const unsigned x0, const unsigned y0, const unsigned x1, const unsigned y1, const bool lod, Vec3f* colors);
+
+//in tiled.cpp, renders a width x height image tile by tile straight into a tiled TIFF, memory does not grow with the image
+int render_tiled(const Scene_t& scene, const frame_params_t& fp, const unsigned width, const unsigned height, const unsigned tile,
+	const int workers_num, const bool lod, const char* file_name);
+
+//in server.cpp, serves render requests on 127.0.0.1:port with base plus the requested model, returns only on failure
+int run_server(const unsigned short port, const Scene_t& base, const unsigned workers_num, const bool lod, const size_t ooc_cache_bytes);
+
 struct render_state_t
 {
 	render_state_t()
-		: width(), height(), pixels_cnt(), workers_num(), terminate(false)
+		: width(), height(), pixels_cnt(), workers_num(), batch_rays(false), sort_rays(true), lod(false), terminate(false)
 	{}
-	unsigned width, height;
+	unsigned width, height;					//window resolution
+	frame_params_t params;					//current frame, guarded by mx, workers wait on cv for a new frame_id
+	std::condition_variable cv;
 	std::vector<unsigned long long> pixels;	//rendered pixels by render, need to move to framebuffer
-	unsigned int pixels_cnt;				//just count of rendered pixels of current frame
+	unsigned int pixels_cnt;				//just count of rendered pixels of current frame, in internal resolution
 	int workers_num;
+	bool batch_rays;						//trace pixels in batches breadth first instead of recursive cast_ray
+	bool sort_rays;							//reorder batched rays by origin cell and direction octant
+	bool lod;								//trace models at the level of detail matching the pixel footprint
+	ray_sort_stats_t ray_stats;				//accumulated by workers under mx
+	std::vector<Vec3f> accum;				//per internal pixel sum over the accumulated frames, guarded by mx
+	std::vector<std::pair<unsigned, surface_t> > surfaces;//primary hits of the traced pixels, when the frame has a retrace mask
 	std::mutex mx;
 	bool terminate;
 };